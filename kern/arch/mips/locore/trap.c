@@ -40,6 +40,9 @@
 #include <mainbus.h>
 #include <syscall.h>
 #include "opt-A3.h"
+#if OPT_A3
+#include <proc.h>
+#endif
 
 
 /* in exception.S */
@@ -197,6 +200,14 @@ mips_trap(struct trapframe *tf)
 		}
 
 		curthread->t_in_interrupt = old_in;
+#if OPT_A3
+		if (!iskern && doadjust && curproc->p_killed) {
+			/* Get back to the state of an ordinary trap and die */
+			spl = splhigh();
+			splx(spl);
+			goto done;
+		}
+#endif
 		goto done2;
 	}
 
@@ -317,6 +328,13 @@ mips_trap(struct trapframe *tf)
 	panic("I can't handle this... I think I'll just die now...\n");
 
  done:
+#if OPT_A3
+	/* Killed for memory while in the kernel; don't go back to user mode */
+	if (!iskern && curproc->p_killed) {
+		sys__exit_signal(SIGKILL);
+	}
+#endif
+
 	/*
 	 * Turn interrupts off on the processor, without affecting the
 	 * stored interrupt state.
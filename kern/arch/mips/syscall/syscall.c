@@ -35,7 +35,9 @@
 #include <thread.h>
 #include <current.h>
 #include <syscall.h>
+#include <copyinout.h>
 #include "opt-A2.h"
+#include "opt-dumbvm.h"
 
 
 /*
@@ -141,6 +143,37 @@ syscall(struct trapframe *tf)
             retval = -1;
             break;
 #endif
+#if !OPT_DUMBVM
+        case SYS_mmap:
+        {
+            // fd and the 64-bit offset don't fit in registers
+            int fd;
+            off_t offset;
+            err = copyin((const_userptr_t)(tf->tf_sp + 16), &fd, sizeof(fd));
+            if (err) {
+                break;
+            }
+            err = copyin((const_userptr_t)(tf->tf_sp + 24), &offset, sizeof(offset));
+            if (err) {
+                break;
+            }
+            err = sys_mmap((userptr_t)tf->tf_a0,
+                           (size_t)tf->tf_a1,
+                           (int)tf->tf_a2,
+                           (int)tf->tf_a3,
+                           fd, offset,
+                           (vaddr_t *)&retval);
+            break;
+        }
+        case SYS_munmap:
+            err = sys_munmap((userptr_t)tf->tf_a0,
+                             (size_t)tf->tf_a1);
+            break;
+        case SYS_sbrk:
+            err = sys_sbrk((intptr_t)tf->tf_a0,
+                           (vaddr_t *)&retval);
+            break;
+#endif
             
             /* Add stuff here */
             
@@ -66,6 +66,18 @@ vm_bootstrap(void)
 #endif
 }
 
+void
+vm_shutdown(void)
+{
+    /* nothing */
+}
+
+bool
+vm_idle(void)
+{
+    return false;
+}
+
 static
 paddr_t
 getppages(unsigned long npages)
@@ -111,14 +123,26 @@ free_kpages(vaddr_t addr)
 void
 vm_tlbshootdown_all(void)
 {
-    panic("dumbvm tried to do tlb shootdown?!\n");
+    int i, spl;
+    
+    spl = splhigh();
+    for (i=0; i<NUM_TLB; i++) {
+        tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+    }
+    splx(spl);
 }
 
 void
 vm_tlbshootdown(const struct tlbshootdown *ts)
 {
-    (void)ts;
-    panic("dumbvm tried to do tlb shootdown?!\n");
+    int i, spl;
+    
+    spl = splhigh();
+    i = tlb_probe(ts->ts_vaddr & PAGE_FRAME, 0);
+    if (i >= 0) {
+        tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+    }
+    splx(spl);
 }
 
 int
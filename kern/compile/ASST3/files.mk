@@ -52,7 +52,6 @@ SRCS.MACHINE.mips+=$(KTOP)/arch/mips/thread/switchframe.c
 SRCS.MACHINE.mips+=$(KTOP)/arch/mips/thread/switch.S
 SRCS.MACHINE.mips+=$(KTOP)/arch/mips/thread/thread_machdep.c
 SRCS.MACHINE.mips+=$(KTOP)/arch/mips/thread/threadstart.S
-SRCS.MACHINE.mips+=$(KTOP)/arch/mips/vm/dumbvm.c
 SRCS.MACHINE.mips+=$(KTOP)/arch/mips/vm/ram.c
 SRCS.MACHINE.mips+=$(TOP)/common/gcc-millicode/adddi3.c
 SRCS.MACHINE.mips+=$(TOP)/common/gcc-millicode/anddi3.c
@@ -88,6 +87,7 @@ SRCS+=$(KTOP)/syscall/loadelf.c
 SRCS+=$(KTOP)/syscall/proc_syscalls.c
 SRCS+=$(KTOP)/syscall/runprogram.c
 SRCS+=$(KTOP)/syscall/time_syscalls.c
+SRCS+=$(KTOP)/syscall/vm_syscalls.c
 SRCS+=$(KTOP)/test/arraytest.c
 SRCS+=$(KTOP)/test/bitmaptest.c
 SRCS+=$(KTOP)/test/fstest.c
@@ -109,6 +109,11 @@ SRCS+=$(KTOP)/vfs/vfslist.c
 SRCS+=$(KTOP)/vfs/vfslookup.c
 SRCS+=$(KTOP)/vfs/vfspath.c
 SRCS+=$(KTOP)/vfs/vnode.c
+SRCS+=$(KTOP)/vm/addrspace.c
 SRCS+=$(KTOP)/vm/coremap.c
 SRCS+=$(KTOP)/vm/kmalloc.c
+SRCS+=$(KTOP)/vm/kmem_cache.c
+SRCS+=$(KTOP)/vm/pagecache.c
+SRCS+=$(KTOP)/vm/swap.c
 SRCS+=$(KTOP)/vm/uw-vmstats.c
+SRCS+=$(KTOP)/vm/vm.c
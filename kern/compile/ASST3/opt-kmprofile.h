@@ -0,0 +1,5 @@
+/* Automatically generated; do not edit */
+#ifndef _OPT_KMPROFILE_H_
+#define _OPT_KMPROFILE_H_
+#define OPT_KMPROFILE 0
+#endif /* _OPT_KMPROFILE_H_ */
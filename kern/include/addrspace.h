@@ -35,8 +35,11 @@
  */
 
 
+#include <array.h>
 #include <vm.h>
+#include <spinlock.h>
 #include "opt-A3.h"
+#include "opt-dumbvm.h"
 
 struct vnode;
 
@@ -48,6 +51,7 @@ struct vnode;
  * You write this.
  */
 
+#if OPT_DUMBVM
 struct addrspace {
     vaddr_t as_vbase1;
     paddr_t as_pbase1;
@@ -61,6 +65,116 @@ struct addrspace {
     
     paddr_t as_stackpbase;
 };
+#else
+/*
+ * The stack starts out VM_STACKPAGES long and grows down a page at a
+ * time as it is touched, up to VM_STACKLIMIT bytes (the RLIMIT_STACK of
+ * every process). The heap and mmap stay out of the space it may grow
+ * into, unless a mapping is put there with MAP_FIXED.
+ */
+#define VM_STACKPAGES    1
+#define VM_STACKLIMIT    (4 * 1024 * 1024)
+
+/* Where mmap starts looking for room when not given an address */
+#define VM_MMAPBASE      0x40000000
+
+/*
+ * A page aligned region of the address space. Pages are only given a
+ * frame the first time they are touched. If the region is backed by a
+ * file (an ELF segment or an mmap), the bytes [rg_filevaddr,
+ * rg_filevaddr + rg_filesize) are read from rg_vnode starting at
+ * rg_fileoffset, and the rest of the region is zero-filled.
+ *
+ * Pages of a shared mapping are shared with everyone else mapping the
+ * same part of the file, and written back to it instead of to swap.
+ */
+struct region {
+    vaddr_t rg_vbase;
+    size_t rg_npages;
+    bool rg_writeable;
+    bool rg_shared;         /* MAP_SHARED */
+    bool rg_mapped;         /* Made by mmap, so munmap can remove it */
+    
+    struct vnode *rg_vnode; /* Holds a reference; NULL if anonymous */
+    vaddr_t rg_filevaddr;
+    off_t rg_fileoffset;
+    size_t rg_filesize;
+};
+
+/*
+ * Array of regions.
+ */
+#ifndef ASINLINE
+#define ASINLINE INLINE
+#endif
+
+DECLARRAY(region);
+DEFARRAY(region, ASINLINE);
+
+/*
+ * Two-level page table. The top 10 bits of a vaddr index the first
+ * level, which only has to cover user space; the next 10 index a second
+ * level table of page table entries, which fills exactly one page.
+ */
+#define PT_L1INDEX(va)          ((va) >> 22)
+#define PT_L2INDEX(va)          (((va) >> 12) & 0x3ff)
+#define PT_L1ENTRIES            (USERSPACETOP >> 22)
+#define PT_L2ENTRIES            1024
+
+/*
+ * A page table entry is 0 if the page has never been touched or can be
+ * fetched again from the executable, the paddr of its frame if it is
+ * resident, or a swap slot tagged with PTE_SWAPPED if it was paged out.
+ */
+#define PTE_SWAPPED             0x1
+#define PTE_ISRESIDENT(pte)     ((pte) != 0 && ((pte) & PTE_SWAPPED) == 0)
+#define PTE_ISSWAPPED(pte)      (((pte) & PTE_SWAPPED) != 0)
+#define PTE_SWAPSLOT(pte)       ((pte) / PAGE_SIZE)
+#define PTE_FROMSLOT(slot)      (((paddr_t)(slot) * PAGE_SIZE) | PTE_SWAPPED)
+
+/*
+ * Software TLB: a direct mapped cache of recent translations, consulted
+ * before the regions and page table when refilling the TLB. Entries hit
+ * since the last few switches are put straight back in the TLB when the
+ * address space is activated; set AS_STLB_PRELOAD to 0 to turn that off.
+ */
+#define AS_STLB_SIZE            64
+#define AS_STLB_PRELOAD         16
+
+struct stlb_entry {
+    vaddr_t se_vaddr;
+    uint32_t se_elo;        /* TLB entry lo, 0 if the slot is empty */
+    uint32_t se_hits;       /* Recent refills, halved on every switch-in */
+    bool se_faultaround;    /* Entered ahead of use, not missed on since */
+};
+
+struct addrspace {
+    /* Regions sorted by rg_vbase, never overlapping */
+    struct regionarray *as_regions;
+    struct region *as_stack;
+    
+    /*
+     * The heap runs from as_heapbase, just past the executable, up to
+     * the break at as_heapend. Its region covers the pages the break
+     * has reached, and doesn't exist until the heap has any.
+     */
+    struct region *as_heap;
+    vaddr_t as_heapbase;
+    vaddr_t as_heapend;
+    
+    paddr_t **as_pagetable; /* Second level tables, NULL until used */
+    uint32_t as_cmowner;    /* Names us in the coremap, for pages we own */
+    
+    struct stlb_entry as_stlb[AS_STLB_SIZE];
+    
+    /*
+     * Protects the page table entries and software TLB against the
+     * pager, which may be pushing one of our pages out to swap from
+     * another thread.
+     */
+    struct spinlock as_lock;
+};
+#endif
 
 /*
  * Functions in addrspace.c:
@@ -113,6 +227,71 @@ int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
 
+#if !OPT_DUMBVM
+/*
+ *    as_define_backing - record that the region containing VADDR is
+ *                backed by FILESIZE bytes of V starting at OFFSET,
+ *                so its pages can be read in on demand.
+ *
+ *    as_find_region - return the region containing VADDR, or NULL.
+ *
+ *    as_grow_stack - extend the stack down to cover VADDR and return
+ *                it, or return NULL if VADDR is out of its reach.
+ *
+ *    as_region_fileslice - work out the part [*FROM, *TO) of the page at
+ *                VADDR in RG that comes from its file. Returns false if
+ *                none of it does.
+ *
+ *    as_map - add a region of LEN bytes backed by V at OFFSET, or
+ *                anonymous memory if V is NULL, with PROT and FLAGS as
+ *                for mmap. It goes at VADDR if that is free, or must
+ *                with MAP_FIXED, and anywhere from VM_MMAPBASE up
+ *                otherwise. Hands back where it went in *RET.
+ *
+ *    as_unmap - remove the mapping of LEN bytes at VADDR, writing back
+ *                its changes first if it is shared.
+ *
+ *    as_sbrk - move the end of the heap by AMOUNT bytes, handing back
+ *                where it was in *OLDBREAK. Pages are only allocated
+ *                when touched, and given back when the heap shrinks.
+ *
+ *    as_lookup_pte - return the page table entry for VADDR, allocating
+ *                its second level table if CREATE is set. Returns NULL
+ *                if there is no table or no memory for one.
+ *
+ *    as_reverse_lookup - return the vaddr at which AS maps the resident
+ *                page PADDR, which must be mapped exactly once and busy.
+ *
+ *    as_stlb_* - look up, add, and drop software TLB entries. Called
+ *                with as_lock held.
+ */
+int               as_define_backing(struct addrspace *as, struct vnode *v,
+                                    off_t offset, vaddr_t vaddr,
+                                    size_t filesize);
+struct region    *as_find_region(struct addrspace *as, vaddr_t vaddr);
+struct region    *as_grow_stack(struct addrspace *as, vaddr_t vaddr);
+bool              as_region_fileslice(struct region *rg, vaddr_t vaddr,
+                                      vaddr_t *from, vaddr_t *to);
+int               as_map(struct addrspace *as, vaddr_t vaddr, size_t len,
+                         int prot, int flags, struct vnode *v,
+                         off_t offset, vaddr_t *ret);
+int               as_unmap(struct addrspace *as, vaddr_t vaddr, size_t len);
+int               as_sbrk(struct addrspace *as, intptr_t amount,
+                          vaddr_t *oldbreak);
+paddr_t          *as_lookup_pte(struct addrspace *as, vaddr_t vaddr,
+                                bool create);
+vaddr_t           as_reverse_lookup(struct addrspace *as, paddr_t paddr);
+bool              as_stlb_lookup(struct addrspace *as, vaddr_t vaddr,
+                                 uint32_t *elo);
+void              as_stlb_insert(struct addrspace *as, vaddr_t vaddr,
+                                 uint32_t elo);
+void              as_stlb_invalidate(struct addrspace *as, vaddr_t vaddr);
+void              as_stlb_faultaround(struct addrspace *as, vaddr_t vaddr,
+                                      uint32_t elo);
+bool              as_stlb_hot(struct addrspace *as, vaddr_t vaddr);
+void              as_stlb_printstats(void);
+#endif
+
 
 /*
  * Functions in loadelf.c
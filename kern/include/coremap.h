@@ -16,4 +16,41 @@ paddr_t cm_getppages(unsigned long npages);
 vaddr_t cm_alloc_kpages(int npages);
 void cm_free_kpages(vaddr_t addr);
 
+// A word kept with each single kernel page for whoever allocated it. It
+// reads 0 for a freshly allocated page, and for pages the coremap
+// doesn't manage, on which setting it does nothing.
+void cm_kpage_settag(vaddr_t addr, uint32_t tag);
+uint32_t cm_kpage_tag(vaddr_t addr);
+
+// Pre-zeroed single pages, refilled by idle cpus from their idle loop
+paddr_t cm_getzeroedpage(void);
+void cm_zero_bootstrap(void);
+bool cm_idle(void);
+
+struct addrspace;
+
+// Reference counts for user pages shared copy-on-write. Both fail if the
+// page is being evicted; wait with cm_page_waitbusy and look again.
+bool cm_page_incref(paddr_t paddr);
+bool cm_page_decref(paddr_t paddr, struct addrspace *as);
+uint32_t cm_page_refcount(paddr_t paddr);
+
+// Slots naming the address space that owns a page, taken by as_create
+int cm_owner_register(struct addrspace *as, uint32_t *slot);
+void cm_owner_unregister(uint32_t slot);
+
+// State the pager uses to pick and write back victims
+void cm_page_touch(paddr_t paddr, struct addrspace *as);
+void cm_page_setdirty(paddr_t paddr);
+bool cm_page_isdirty(paddr_t paddr);
+bool cm_page_isbusy(paddr_t paddr);
+void cm_page_waitbusy(paddr_t paddr);
+
+// Pages owned by as, which is what killing it would give back. The
+// caller keeps as from being destroyed, e.g. by holding p_lock.
+uint32_t cm_resident_pages(struct addrspace *as);
+
+// Print free page counts and per-cpu page cache hit rates
+void cm_printstats(void);
+
 #endif /* defined(__cs350Proj__coremap__) */
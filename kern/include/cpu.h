@@ -34,6 +34,7 @@
 #include <spinlock.h>
 #include <threadlist.h>
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
+#include <uw-vmstats.h>  /* for VMSTAT_COUNT */
 
 
 /*
@@ -46,6 +47,14 @@
  * a pointer with a fixed address and a per-cpu mapping in the MMU.
  */
 
+/* Number of free pages each cpu may keep in front of the coremap */
+#define CPU_PAGECACHE_MAX 32
+
+/* Number of kmalloc size classes, each with its own per-cpu magazines */
+#define CPU_KMALLOC_NSIZES 8
+
+struct kmalloc_magazine;
+
 struct cpu {
 	/*
 	 * Fixed after allocation.
@@ -60,6 +69,36 @@ struct cpu {
 	struct thread *c_curthread;	/* Current thread on cpu */
 	struct threadlist c_zombies;	/* List of exited threads */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
+	unsigned c_tlb_hand;		/* Next TLB slot to refill */
+
+	/*
+	 * Address space whose translations the TLB may hold. Other
+	 * cpus read it without a lock, to decide whose TLB a shootdown
+	 * has to reach; see vm_tlbshootdown_pages.
+	 */
+	struct addrspace *c_tlb_as;
+
+	/*
+	 * This cpu's share of the VM statistics (see vm/uw-vmstats.c).
+	 * Only this cpu writes them, with interrupts off; other cpus
+	 * read them to add up the totals.
+	 */
+	unsigned c_vmstats[VMSTAT_COUNT];
+
+	/*
+	 * Software TLB statistics (see vm/addrspace.c), counted the
+	 * same way while holding the address space's lock.
+	 */
+	unsigned c_stlb_hits;
+	unsigned c_stlb_misses;
+	unsigned c_stlb_preloads;
+	unsigned c_stlb_faultarounds;
+	unsigned c_stlb_faultaround_misses;
+
+	/* TLB shootdowns this cpu sent (see vm/vm.c), bumped at splhigh */
+	unsigned c_shootdowns;
+	unsigned c_shootdown_ipis;
+	unsigned c_shootdown_flushes;
 
 	/*
 	 * Accessed by other cpus.
@@ -82,11 +121,39 @@ struct cpu {
 	 * struct tlbshootdown is machine-dependent and might
 	 * reasonably be either an address space and vaddr pair, or a
 	 * paddr, or something else.
+	 *
+	 * c_shootdownseq counts the batches of shootdowns handled,
+	 * so ipi_tlbshootdown_wait can tell when its own is done.
 	 */
 	uint32_t c_ipi_pending;		/* One bit for each IPI number */
 	struct tlbshootdown c_shootdown[TLBSHOOTDOWN_MAX];
 	int c_numshootdown;
+	unsigned c_shootdownseq;
 	struct spinlock c_ipi_lock;
+
+	/*
+	 * Cache of free single pages in front of the coremap (see
+	 * vm/coremap.c). Normally accessed only by this cpu; other
+	 * cpus take the lock only to reclaim pages when memory is
+	 * short. The pages in it are marked in use in the coremap.
+	 */
+	paddr_t c_pagecache[CPU_PAGECACHE_MAX];
+	unsigned c_pagecache_count;
+	unsigned c_pagecache_hits;	/* allocs served from the cache */
+	unsigned c_pagecache_misses;	/* allocs that had to refill */
+	unsigned c_pagecache_frees;	/* frees that went to the cache */
+	unsigned c_pagecache_drains;	/* frees that had to drain */
+	struct spinlock c_pagecache_lock;
+
+	/*
+	 * Magazines of free kmalloc blocks, two for each size class
+	 * (see vm/kmalloc.c). Accessed only by this cpu, with
+	 * interrupts off, except that other cpus may read the counts.
+	 */
+	struct kmalloc_magazine *c_kmalloc_loaded[CPU_KMALLOC_NSIZES];
+	struct kmalloc_magazine *c_kmalloc_previous[CPU_KMALLOC_NSIZES];
+	unsigned c_kmalloc_hits;	/* served without taking a lock */
+	unsigned c_kmalloc_misses;	/* had to go to the depot or pages */
 };
 
 #define TLBSHOOTDOWN_ALL  (-1)
@@ -109,6 +176,13 @@ void cpu_machdep_init(struct cpu *);
 /*ASMLINKAGE*/ void cpu_start_secondary(void);
 void cpu_hatch(unsigned software_number);
 
+/*
+ * Look up cpus by software number, for subsystems that keep per-cpu
+ * state and occasionally need to visit all of it.
+ */
+unsigned cpu_count(void);
+struct cpu *cpu_get(unsigned number);
+
 /*
  * Return a string describing the CPU type.
  */
@@ -152,6 +226,9 @@ void cpu_halt(void);
  * ipi_send sends an IPI to one CPU.
  * ipi_broadcast sends an IPI to all CPUs except the current one.
  * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data.
+ * ipi_tlbshootdown_wait queues N shootdowns at once (more than
+ * TLBSHOOTDOWN_MAX becomes a full flush) and waits for the target to
+ * carry them out. It must be called with interrupts enabled.
  *
  * interprocessor_interrupt is called on the target CPU when an IPI is
  * received.
@@ -166,6 +243,8 @@ void cpu_halt(void);
 void ipi_send(struct cpu *target, int code);
 void ipi_broadcast(int code);
 void ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping);
+void ipi_tlbshootdown_wait(struct cpu *target,
+			   const struct tlbshootdown *mappings, unsigned n);
 
 void interprocessor_interrupt(void);
 
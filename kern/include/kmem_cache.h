@@ -0,0 +1,53 @@
+#ifndef __cs350Proj__kmem_cache__
+#define __cs350Proj__kmem_cache__
+
+#include <spinlock.h>
+
+/*
+ * Caches of constructed objects of one type, in front of kmalloc.
+ *
+ * The constructor runs when an object is first allocated from kmalloc,
+ * and sets up the parts that stay the same from one use to the next
+ * (wait channels, arrays, stacks). A freed object goes back to its
+ * cache as it is, so kmem_cache_alloc can hand it out again without
+ * building it again. The destructor only runs when the cache is full
+ * or memory runs short, and the object goes back to kmalloc.
+ *
+ * So whoever frees an object has to leave it the way the constructor
+ * made it: unlocked, with empty lists, and so on. Either hook may be
+ * NULL. The constructor returns 0 or an error code.
+ *
+ * Caches are declared statically with KMEM_CACHE_INITIALIZER, so they
+ * can be used before anything else is set up.
+ */
+
+#define KMEM_CACHE_MAX 16
+
+struct kmem_cache {
+    const char *name;
+    size_t size;
+    int (*ctor)(void *obj);
+    void (*dtor)(void *obj);
+    unsigned max;               // Objects to keep, at most KMEM_CACHE_MAX
+    struct spinlock lock;
+    void *objs[KMEM_CACHE_MAX];
+    unsigned count;
+    unsigned hits;
+    unsigned misses;
+    bool listed;                // On the list kmem_cache_printstats walks
+    struct kmem_cache *next;
+};
+
+#define KMEM_CACHE_INITIALIZER(name, size, ctor, dtor, max) \
+    { name, size, ctor, dtor, max, SPINLOCK_INITIALIZER, { NULL }, 0, 0, 0, false, NULL }
+
+void *kmem_cache_alloc(struct kmem_cache *cache);
+void kmem_cache_free(struct kmem_cache *cache, void *obj);
+
+// Destroy every object sitting in a cache and give it back to kmalloc,
+// for when memory runs short. Returns how many went.
+unsigned kmem_cache_reclaim_all(void);
+
+void kmem_cache_printstats(void);
+
+#endif /* defined(__cs350Proj__kmem_cache__) */
@@ -0,0 +1,25 @@
+#ifndef __cs350Proj__kmprofile__
+#define __cs350Proj__kmprofile__
+
+#include "opt-kmprofile.h"
+
+/*
+ * kmalloc allocation-site profiler, built in with "options kmprofile".
+ *
+ * kmalloc and kfree report every block along with the address they were
+ * called from. Each block is counted against the call site and size
+ * class that allocated it, so the "kp" menu command can show which
+ * callers hold the most memory (leaks show up here) and which allocate
+ * the most often. Anything allocated through a wrapper such as kstrdup,
+ * array or kmem_cache shows up as the wrapper.
+ */
+
+#if OPT_KMPROFILE
+void kmprofile_alloc(void *ptr, size_t size, size_t blockSize, vaddr_t caller);
+void kmprofile_free(void *ptr);
+
+// Print the top callers; reset starts counting allocations over
+void kmprofile_print(bool reset);
+#endif
+
+#endif /* defined(__cs350Proj__kmprofile__) */
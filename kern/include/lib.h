@@ -127,6 +127,7 @@ uint32_t random(void);
 void *kmalloc(size_t size);
 void kfree(void *ptr);
 void kheap_printstats(void);
+unsigned kheap_reclaim(void);
 
 /*
  * C string functions. 
@@ -0,0 +1,28 @@
+#ifndef __cs350Proj__pagecache__
+#define __cs350Proj__pagecache__
+
+struct vnode;
+
+// Find the page holding PAGE_SIZE bytes of vn at offset, which must be
+// page-aligned. On a hit the page has gained a reference for the
+// caller; 0 means a miss. Pages looked up with pin set stay cached for
+// as long as anyone maps them.
+paddr_t pagecache_lookup(struct vnode *vn, off_t offset, bool pin);
+
+// Share the caller's freshly read page at paddr with later lookups.
+// Returns the page now cached, which may be one somebody else got in
+// first with (holding a reference for the caller), or 0 if there was
+// no memory to cache it.
+paddr_t pagecache_insert(struct vnode *vn, off_t offset, paddr_t paddr, bool pin);
+
+// Stop caching every page of vn, because the file is about to change.
+// Called from vfs_open when vn is opened for writing.
+void pagecache_invalidate(struct vnode *vn);
+
+// Stop caching every page at most one address space still maps.
+// Returns the number of pages let go.
+unsigned pagecache_reclaim(void);
+
+void pagecache_printstats(void);
+
+#endif /* defined(__cs350Proj__pagecache__) */
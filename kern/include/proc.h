@@ -39,6 +39,8 @@
 #include <spinlock.h>
 #include <thread.h> /* required for struct threadarray */
 #include "opt-A2.h"
+#include "opt-A3.h"
+#include "opt-dumbvm.h"
 #include <array.h>
 #include <types.h>
 #include <synch.h>
@@ -82,6 +84,10 @@ struct proc {
     struct lock *exitLock;
     struct cv *exitCv;
 #endif
+
+#if OPT_A3
+    volatile bool p_killed; /* Exit instead of returning to user mode */
+#endif
 };
 
 /* This is the process structure for the kernel and for kernel-only threads. */
@@ -108,7 +114,7 @@ int proc_addthread(struct proc *proc, struct thread *t);
 void proc_remthread(struct thread *t);
 
 #if OPT_A2
-/* A child has exited. */
+/* A child has exited, with waitpid status EXITCODE. */
 void proc_child_exited(pid_t childPid, int exitcode);
 
 /* Get the exit code of an exited child process. */
@@ -127,6 +133,11 @@ int proc_exists(pid_t pid);
 void proc_free_pid(pid_t pid);
 #endif // OPT_A2
 
+#if OPT_A3 && !OPT_DUMBVM
+/* Pick a process to kill for memory. Returns false if there is none. */
+bool proc_oom_kill(void);
+#endif
+
 /* Fetch the address space of the current process. */
 struct addrspace *curproc_getas(void);
 
@@ -0,0 +1,20 @@
+#ifndef __cs350Proj__swap__
+#define __cs350Proj__swap__
+
+// Raw disk that user pages are paged out to
+#define SWAP_DEVICE "lhd1raw:"
+
+void swap_bootstrap(void);
+
+// Write the page at paddr to a newly allocated slot, returned in slot
+int swap_out(paddr_t paddr, uint32_t *slot);
+
+// Read slot back into the page at paddr. The slot is still allocated.
+int swap_in(uint32_t slot, paddr_t paddr);
+
+// Duplicate slot into a newly allocated one, for fork
+int swap_copy(uint32_t slot, uint32_t *newSlot);
+
+void swap_free(uint32_t slot);
+
+#endif /* defined(__cs350Proj__swap__) */
@@ -31,6 +31,8 @@
 #define _SYSCALL_H_
 
 #include "opt-A2.h"
+#include "opt-A3.h"
+#include "opt-dumbvm.h"
 
 
 struct trapframe; /* from <machine/trapframe.h> */
@@ -65,10 +67,22 @@ int sys_waitpid(pid_t pid, userptr_t status, int options, pid_t *retval);
 
 #endif // UW
 
+#if OPT_A3
+/* Exit the current process as though killed by signal SIG. */
+void sys__exit_signal(int sig);
+#endif
+
 #if OPT_A2
 int sys_fork(struct trapframe *parentTrapFrame, pid_t *retval);
 void fork_entrypoint(void *childTrapFrame, unsigned long unusednum);
 int sys_execv(const char *program, char **args);
 #endif
 
+#if !OPT_DUMBVM
+int sys_mmap(userptr_t addr, size_t len, int prot, int flags, int fd,
+             off_t offset, vaddr_t *retval);
+int sys_munmap(userptr_t addr, size_t len);
+int sys_sbrk(intptr_t amount, vaddr_t *retval);
+#endif
+
 #endif /* _SYSCALL_H_ */
@@ -10,11 +10,15 @@
 /* Tracks stats on user programs */
 
 /* NOTE !!!!!! WARNING !!!!!
- * All of the functions (except vmstats_print) whose names begin with '_'
+ * All of the functions whose names begin with '_'
  * assume that atomicity is ensured elsewhere
  * (i.e., outside of these routines) by acquiring stats_lock.
  * All of the functions whose names do not begin
- * with '_' ensure atomicity locally (except vmstats_print).
+ * with '_' ensure atomicity locally.
+ * The exception is the increments, which only touch the
+ * current cpu's counters and take no lock: vmstats_inc
+ * turns interrupts off itself, and _vmstats_inc assumes
+ * they are already off.
  *
  * Generally you will use the functions whose names
  * do not begin with '_'.
@@ -36,7 +40,8 @@
 #define VMSTAT_ELF_FILE_READ          (7)
 #define VMSTAT_SWAP_FILE_READ         (8)
 #define VMSTAT_SWAP_FILE_WRITE        (9)
-#define VMSTAT_COUNT                 (10)
+#define VMSTAT_PAGE_FAULT_CACHED     (10)
+#define VMSTAT_COUNT                 (11)
 
 /* ----------------------------------------------------------------------- */
 
@@ -49,10 +54,17 @@ void _vmstats_init(void);                    /* atomicity must be ensured elsewh
  *   vmstats_inc(VMSTAT_TLB_FAULT);
  *   vmstats_inc(VMSTAT_PAGE_FAULT_ZERO);
  */
-void vmstats_inc(unsigned int index);    /* uses locking */
-void _vmstats_inc(unsigned int index);   /* atomicity must be ensured elsewhere */
+void vmstats_inc(unsigned int index);    /* per-cpu, no lock; turns interrupts off */
+void _vmstats_inc(unsigned int index);   /* per-cpu, no lock; interrupts must be off */
+
+/* Add up every cpu's counts into COUNTS (if not NULL), and if RESET
+ * is set, start them all again from zero.
+ */
+void vmstats_snapshot(unsigned int counts[VMSTAT_COUNT], bool reset);  /* uses locking */
+void _vmstats_snapshot(unsigned int counts[VMSTAT_COUNT], bool reset); /* atomicity must be ensured elsewhere */
 
 /* Print the statistics: assumes that at least vmstats_init has been called */
-void vmstats_print(void);                    /* Does NOT use locking */
+void vmstats_print(void);                    /* uses locking */
+void vmstats_print_reset(void);              /* uses locking, then resets */
 
 #endif /* VM_STATS_H */
@@ -48,9 +48,25 @@
 /* Initialization function */
 void vm_bootstrap(void);
 
+/* Called on the way down, to report VM statistics */
+void vm_shutdown(void);
+
+/* Idle-time work for a cpu; returns true once it has a thread to run */
+bool vm_idle(void);
+
 /* Fault handling function called by trap code */
 int vm_fault(int faulttype, vaddr_t faultaddress);
 
+/* Page out the frame at PADDR, mapped only by AS (called by the coremap) */
+struct addrspace;
+int vm_evictpage(struct addrspace *as, paddr_t paddr);
+
+/* Invalidate NPAGES pages of AS from VADDR on, on every cpu that needs it */
+void vm_tlbshootdown_pages(struct addrspace *as, vaddr_t vaddr, unsigned npages);
+
+/* Move the frame FROM, mapped only by AS, to TO (called by the coremap) */
+void vm_movepage(struct addrspace *as, paddr_t from, paddr_t to);
+
 /* Allocate/free kernel heap pages (called by kmalloc/kfree) */
 vaddr_t alloc_kpages(int npages);
 void free_kpages(vaddr_t addr);
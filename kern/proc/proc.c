@@ -43,6 +43,7 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <proc.h>
 #include <current.h>
 #include <addrspace.h>
@@ -51,9 +52,15 @@
 #include <synch.h>
 #include <kern/fcntl.h>  
 #include "opt-A2.h"
+#include "opt-A3.h"
+#include "opt-dumbvm.h"
 #include <limits.h>
 #include <synch.h>
 #include <array.h>
+#include <kmem_cache.h>
+#if OPT_A3
+#include <coremap.h>
+#endif
 
 /*
  * The process for the kernel; this holds all the kernel-only threads.
@@ -80,6 +87,73 @@ static int hasPidExited[PID_MAX];
 static int exitCodes[PID_MAX];
 #endif
 
+#if OPT_A3
+/* Live processes by pid, for the out-of-memory killer to choose from */
+static struct proc *procTable[PID_MAX];
+static struct spinlock procTableLock = SPINLOCK_INITIALIZER;
+#endif
+
+/*
+ * Proc structures are recycled through a kmem_cache. A cached one keeps
+ * its thread array, lock, children arrays and exit cv, all empty, so
+ * only the name and the per-process fields are set up on each create.
+ * The exit lock isn't kept, since waitpid destroys it after the proc
+ * is gone.
+ */
+static
+int
+proc_ctor(void *obj)
+{
+	struct proc *proc = obj;
+
+	proc->p_name = NULL;
+	threadarray_init(&proc->p_threads);
+	spinlock_init(&proc->p_lock);
+
+#if OPT_A2
+    proc->childrenPids = array_create();
+    proc->childrenProcesses = array_create();
+    proc->exitCv = cv_create("exit");
+    if (proc->childrenPids == NULL || proc->childrenProcesses == NULL ||
+        proc->exitCv == NULL) {
+        if (proc->childrenPids != NULL) {
+            array_destroy(proc->childrenPids);
+        }
+        if (proc->childrenProcesses != NULL) {
+            array_destroy(proc->childrenProcesses);
+        }
+        if (proc->exitCv != NULL) {
+            cv_destroy(proc->exitCv);
+        }
+        threadarray_cleanup(&proc->p_threads);
+        spinlock_cleanup(&proc->p_lock);
+        return ENOMEM;
+    }
+#endif
+
+	return 0;
+}
+
+static
+void
+proc_dtor(void *obj)
+{
+	struct proc *proc = obj;
+
+#if OPT_A2
+    array_destroy(proc->childrenPids);
+    array_destroy(proc->childrenProcesses);
+    cv_destroy(proc->exitCv);
+#endif
+
+	threadarray_cleanup(&proc->p_threads);
+	spinlock_cleanup(&proc->p_lock);
+}
+
+static struct kmem_cache proc_cache =
+	KMEM_CACHE_INITIALIZER("proc", sizeof(struct proc), proc_ctor,
+			       proc_dtor, KMEM_CACHE_MAX);
+
 /*
  * Create a proc structure.
  */
@@ -89,19 +163,16 @@ proc_create(const char *name)
 {
 	struct proc *proc;
 
-	proc = kmalloc(sizeof(*proc));
+	proc = kmem_cache_alloc(&proc_cache);
 	if (proc == NULL) {
 		return NULL;
 	}
 	proc->p_name = kstrdup(name);
 	if (proc->p_name == NULL) {
-		kfree(proc);
+		kmem_cache_free(&proc_cache, proc);
 		return NULL;
 	}
 
-	threadarray_init(&proc->p_threads);
-	spinlock_init(&proc->p_lock);
-
 	/* VM fields */
 	proc->p_addrspace = NULL;
 
@@ -113,21 +184,29 @@ proc_create(const char *name)
 #endif // UW
     
 #if OPT_A2
-    proc->childrenPids = array_create();
-    proc->childrenProcesses = array_create();
     proc->exitLock = lock_create(name);
-    proc->exitCv = cv_create(name);
     proc->hasParentExited = 0;
+    if (proc->exitLock == NULL) {
+        kfree(proc->p_name);
+        proc->p_name = NULL;
+        kmem_cache_free(&proc_cache, proc);
+        return NULL;
+    }
+#endif
+
+#if OPT_A3
+    proc->p_killed = false;
 #endif
 
 	return proc;
 }
 
 /*
- * Destroy a proc structure.
+ * Free a proc structure, without counting it as a process going away.
  */
+static
 void
-proc_destroy(struct proc *proc)
+proc_cleanup(struct proc *proc)
 {
 	/*
          * note: some parts of the process structure, such as the address space,
@@ -154,15 +233,12 @@ proc_destroy(struct proc *proc)
 	}
     
 #if OPT_A2
+    // Empty the arrays for the next user of this proc structure
     for (unsigned i = array_num(proc->childrenPids); i > 0; i--) {
         kfree(array_get(proc->childrenPids, i - 1));
         array_remove(proc->childrenPids, i - 1);
         array_remove(proc->childrenProcesses, i - 1);
     }
-    array_destroy(proc->childrenPids);
-    array_destroy(proc->childrenProcesses);
-    
-    cv_destroy(proc->exitCv);
 #endif
 
 
@@ -192,11 +268,45 @@ proc_destroy(struct proc *proc)
 	}
 #endif // UW
 
-	threadarray_cleanup(&proc->p_threads);
-	spinlock_cleanup(&proc->p_lock);
+	KASSERT(threadarray_num(&proc->p_threads) == 0);
 
 	kfree(proc->p_name);
-	kfree(proc);
+	proc->p_name = NULL;
+	kmem_cache_free(&proc_cache, proc);
+}
+
+/*
+ * Undo proc_create for a proc that was never handed out. Unlike a proc
+ * that has run, nobody will wait for it, so its exit lock goes too.
+ */
+static
+void
+proc_uncreate(struct proc *proc)
+{
+#if OPT_A2
+	lock_destroy(proc->exitLock);
+	proc->exitLock = NULL;
+#endif
+	proc_cleanup(proc);
+}
+
+/*
+ * Destroy a proc structure.
+ */
+void
+proc_destroy(struct proc *proc)
+{
+	KASSERT(proc != NULL);
+	KASSERT(proc != kproc);
+
+#if OPT_A3
+	spinlock_acquire(&procTableLock);
+	KASSERT(procTable[proc->pid] == proc);
+	procTable[proc->pid] = NULL;
+	spinlock_release(&procTableLock);
+#endif
+
+	proc_cleanup(proc);
 
 #ifdef UW
 	/* decrement the process count */
@@ -258,10 +368,13 @@ proc_create_runprogram(const char *name)
 	/* open the console - this should always succeed */
 	console_path = kstrdup("con:");
 	if (console_path == NULL) {
-	  panic("unable to copy console path name during process creation\n");
+	  proc_uncreate(proc);
+	  return NULL;
 	}
 	if (vfs_open(console_path,O_WRONLY,0,&(proc->console))) {
-	  panic("unable to open the console during process creation\n");
+	  kfree(console_path);
+	  proc_uncreate(proc);
+	  return NULL;
 	}
 	kfree(console_path);
 #endif // UW
@@ -289,15 +402,6 @@ proc_create_runprogram(const char *name)
 	spinlock_release(&curproc->p_lock);
 #endif // UW
 
-#ifdef UW
-	/* increment the count of processes */
-        /* we are assuming that all procs, including those created by fork(),
-           are created using a call to proc_create_runprogram  */
-	P(proc_count_mutex); 
-	proc_count++;
-	V(proc_count_mutex);
-#endif // UW
-    
 #if OPT_A2
     // set the pid for the user process
     spinlock_acquire(&curproc->p_lock);
@@ -313,6 +417,7 @@ proc_create_runprogram(const char *name)
         if (foundPid == 0) {
             // We searched all pids and they were all being used, return null since we can't create a new proc
             spinlock_release(&curproc->p_lock);
+            proc_uncreate(proc);
             return NULL;
         }
     }
@@ -321,6 +426,21 @@ proc_create_runprogram(const char *name)
     spinlock_release(&curproc->p_lock);
 #endif
 
+#if OPT_A3
+    spinlock_acquire(&procTableLock);
+    procTable[proc->pid] = proc;
+    spinlock_release(&procTableLock);
+#endif
+
+#ifdef UW
+	/* increment the count of processes */
+        /* we are assuming that all procs, including those created by fork(),
+           are created using a call to proc_create_runprogram  */
+	P(proc_count_mutex); 
+	proc_count++;
+	V(proc_count_mutex);
+#endif // UW
+
 	return proc;
 }
 
@@ -470,3 +590,47 @@ void proc_free_pid(pid_t pid)
     spinlock_release(&curproc->p_lock);
 }
 #endif
+
+#if OPT_A3 && !OPT_DUMBVM
+/*
+ * Out of memory: mark the process with the most resident pages to be
+ * killed. It exits the next time it leaves the kernel, and gives its
+ * memory back then. Processes already marked are passed over, since one
+ * asleep in waitpid or a console read may never get that far. Returns
+ * false if there is nobody to kill.
+ */
+bool proc_oom_kill(void)
+{
+    struct proc *victim = NULL;
+    uint32_t victimPages = 0;
+
+    spinlock_acquire(&procTableLock);
+    for (int i = 0; i < PID_MAX; i++) {
+        struct proc *p = procTable[i];
+        if (p == NULL || p->p_killed) {
+            continue;
+        }
+
+        // Holding p_lock keeps the address space from being destroyed
+        spinlock_acquire(&p->p_lock);
+        uint32_t pages = 0;
+        if (p->p_addrspace != NULL) {
+            pages = cm_resident_pages(p->p_addrspace);
+        }
+        spinlock_release(&p->p_lock);
+
+        if (pages > victimPages) {
+            victim = p;
+            victimPages = pages;
+        }
+    }
+    if (victim != NULL) {
+        victim->p_killed = true;
+        kprintf("Out of memory: killing pid %d (%s), %u pages resident\n",
+                victim->pid, victim->p_name, victimPages);
+    }
+    spinlock_release(&procTableLock);
+
+    return victim != NULL;
+}
+#endif
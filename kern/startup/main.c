@@ -147,6 +147,8 @@ shutdown(void)
 
 	kprintf("Shutting down.\n");
 	
+	vm_shutdown();
+
 	vfs_clearbootfs();
 	vfs_clearcurdir();
 	vfs_unmountall();
@@ -42,10 +42,15 @@
 #include <sfs.h>
 #include <syscall.h>
 #include <test.h>
+#include <coremap.h>
+#include <kmem_cache.h>
+#include <kmprofile.h>
+#include <uw-vmstats.h>
 #include "opt-synchprobs.h"
 #include "opt-sfs.h"
 #include "opt-net.h"
 #include "opt-A2.h"
+#include "opt-kmprofile.h"
 
 /*
  * In-kernel menu and command dispatcher.
@@ -401,10 +406,61 @@ cmd_kheapstats(int nargs, char **args)
 	(void)args;
 
 	kheap_printstats();
+	kmem_cache_printstats();
 	
 	return 0;
 }
 
+static
+int
+cmd_vmstats(int nargs, char **args)
+{
+	if (nargs == 1) {
+		vmstats_print();
+	}
+	else if (nargs == 2 && !strcmp(args[1], "-r")) {
+		vmstats_print_reset();
+	}
+	else {
+		kprintf("Usage: vs [-r]\n");
+		return EINVAL;
+	}
+
+	return 0;
+}
+
+#if OPT_KMPROFILE
+static
+int
+cmd_kmprofile(int nargs, char **args)
+{
+	if (nargs == 1) {
+		kmprofile_print(false);
+	}
+	else if (nargs == 2 && !strcmp(args[1], "-r")) {
+		kmprofile_print(true);
+	}
+	else {
+		kprintf("Usage: kp [-r]\n");
+		return EINVAL;
+	}
+
+	return 0;
+}
+#endif
+
+static
+int
+cmd_coremapstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	cm_printstats();
+
+	return 0;
+}
+
 /*
  * Command for debugging threads.
  */
@@ -527,6 +583,11 @@ static const char *mainmenu[] = {
 #endif /* UW */
 #endif
 	"[kh] Kernel heap stats              ",
+#if OPT_KMPROFILE
+	"[kp] kmalloc profile (-r to reset)  ",
+#endif
+	"[cm] Coremap stats                  ",
+	"[vs] VM stats (-r to reset)         ",
 	"[q] Quit and shut down              ",
 	"[dth] Debug Threads                 ",
 	NULL
@@ -584,6 +645,11 @@ static struct {
 
 	/* stats */
 	{ "kh",         cmd_kheapstats },
+#if OPT_KMPROFILE
+	{ "kp",         cmd_kmprofile },
+#endif
+	{ "cm",         cmd_coremapstats },
+	{ "vs",         cmd_vmstats },
 
 	/* base system tests */
 	{ "at",		arraytest },
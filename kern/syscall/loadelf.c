@@ -60,7 +60,43 @@
 #include <vnode.h>
 #include <elf.h>
 #include "opt-A3.h"
+#include "opt-dumbvm.h"
 
+#if !OPT_DUMBVM
+/*
+ * Record the segment at virtual address VADDR as the backing for the
+ * region that holds it. The segment in memory extends from VADDR up to
+ * (but not including) VADDR+MEMSIZE. The segment on disk is located at
+ * file offset OFFSET and has length FILESIZE.
+ *
+ * Nothing is read here: vm_fault reads each page in the first time it
+ * is touched, and zero-fills whatever lies past FILESIZE.
+ *
+ * Nothing is copied through uiomove either, so it no longer catches an
+ * executable whose load address is in kernel space. That check is made
+ * by as_add_region, which rejects any region that extends past
+ * USERSPACETOP when as_define_region sets it up.
+ */
+static
+int
+load_segment(struct addrspace *as, struct vnode *v,
+             off_t offset, paddr_t vaddr,
+             size_t memsize, size_t filesize,
+             int is_executable)
+{
+    (void)is_executable;
+    
+    if (filesize > memsize) {
+        kprintf("ELF: warning: segment filesize > segment memsize\n");
+        filesize = memsize;
+    }
+    
+    DEBUG(DB_EXEC, "ELF: Deferring %lu bytes at 0x%lx\n",
+          (unsigned long) filesize, (unsigned long) vaddr);
+    
+    return as_define_backing(as, v, offset, vaddr, filesize);
+}
+#else
 /*
  * Load a segment at virtual address VADDR. The segment in memory
  * extends from VADDR up to (but not including) VADDR+MEMSIZE. The
@@ -183,6 +219,7 @@ load_segment(struct addrspace *as, struct vnode *v,
     
     return result;
 }
+#endif /* OPT_DUMBVM */
 
 /*
  * Load an ELF executable user program into the current address space.
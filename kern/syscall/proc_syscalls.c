@@ -10,18 +10,22 @@
 #include <addrspace.h>
 #include <copyinout.h>
 #include "opt-A2.h"
+#include "opt-A3.h"
 #include <vfs.h>
 #include <kern/fcntl.h>
 #include "copyinout.h"
 #include "limits.h"
 #include <machine/trapframe.h>
+#include <kmem_cache.h>
 
-void sys__exit(int exitcode) {
+/*
+ * Tear down the current process, leaving WAITSTATUS for waitpid to hand
+ * back as is. Used both by _exit and for processes that were killed.
+ */
+static void exit_with_status(int waitstatus) {
     struct addrspace *as;
     struct proc *p = curproc;
     
-    DEBUG(DB_SYSCALL,"Syscall: _exit(%d)\n",exitcode);
-    
 #if OPT_A2
     spinlock_acquire(&curproc->p_lock);
     for (unsigned i = 0; i < array_num(p->childrenPids); i++) {
@@ -49,13 +53,15 @@ void sys__exit(int exitcode) {
     }
     spinlock_release(&curproc->p_lock);
     
-    proc_child_exited(p->pid, exitcode); // Mark this process as having exited, and save its exit code
+    proc_child_exited(p->pid, waitstatus); // Mark this process as having exited, and save its exit status
     if (p->hasParentExited == 1) {
         proc_free_pid(p->pid);
     }
     lock_acquire(p->exitLock);
     cv_broadcast(p->exitCv, p->exitLock); // Wake any procs that called waitpid for the exiting pid
     lock_release(p->exitLock);
+#else
+    (void)waitstatus;
 #endif
     
     KASSERT(curproc->p_addrspace != NULL);
@@ -83,6 +89,18 @@ void sys__exit(int exitcode) {
     panic("return from thread_exit in sys_exit\n");
 }
 
+void sys__exit(int exitcode) {
+    DEBUG(DB_SYSCALL,"Syscall: _exit(%d)\n",exitcode);
+    exit_with_status(_MKWAIT_EXIT(exitcode));
+}
+
+#if OPT_A3
+void sys__exit_signal(int sig) {
+    DEBUG(DB_SYSCALL,"Killed by signal %d\n",sig);
+    exit_with_status(_MKWAIT_SIG(sig));
+}
+#endif
+
 int sys_getpid(pid_t *retval)
 {
 #if OPT_A2
@@ -156,8 +174,6 @@ int sys_waitpid(pid_t pid,
         lock_destroy(childProcLock);
         
     }
-    
-    exitstatus = _MKWAIT_EXIT(exitstatus);
 #else
     /* for now, just pretend the exitstatus is 0 */
     exitstatus = 0;
@@ -195,6 +211,25 @@ fork_entrypoint(void *childTrapFrame, unsigned long unusednum)
     panic("fork_entrypoint returned\n");
 }
 
+/*
+ * Undo proc_create_runprogram for a child that never got to run.
+ */
+static void fork_abort(struct proc *child)
+{
+    // Detach it first, like curproc_setas, so the OOM killer can't see it
+    spinlock_acquire(&child->p_lock);
+    struct addrspace *as = child->p_addrspace;
+    child->p_addrspace = NULL;
+    spinlock_release(&child->p_lock);
+    if (as != NULL) {
+        as_destroy(as);
+    }
+    proc_child_exited(child->pid, _MKWAIT_EXIT(0));
+    proc_free_pid(child->pid);
+    lock_destroy(child->exitLock);
+    proc_destroy(child);
+}
+
 int sys_fork(struct trapframe *parentTrapFrame, pid_t *retval)
 {
     struct proc *parent = curproc;
@@ -203,39 +238,158 @@ int sys_fork(struct trapframe *parentTrapFrame, pid_t *retval)
         return(ENPROC); // Unable to create a new process, because the max amount has already been used
     }
     
-    // Store the child and its pid onto its parent
-    lock_acquire(child->exitLock);
-    int *childPid = kmalloc(sizeof(pid_t));
-    *childPid = child->pid;
-    int ret = array_add(parent->childrenPids, childPid, NULL);
-    KASSERT(ret == 0);
-    int ret2 = array_add(parent->childrenProcesses, child, NULL);
-    KASSERT(ret2 == 0);
-    lock_release(child->exitLock);
-    
     // Copy Parent's trapframe onto heap
     struct trapframe *childTrapFrame = (struct trapframe*)kmalloc(sizeof(struct trapframe));
-    KASSERT(childTrapFrame != NULL);
+    if (childTrapFrame == NULL) {
+        fork_abort(child);
+        return ENOMEM;
+    }
     *childTrapFrame = *parentTrapFrame;
     
     // Copy the parent's address space to child
     KASSERT(parent->p_addrspace != NULL); /* Parent should have an addrspace */
     KASSERT(child->p_addrspace == NULL); /* Child should not have an addrspace */
-    int asCopyReturn = as_copy(parent->p_addrspace, &child->p_addrspace);
-    if (asCopyReturn) {
-        return asCopyReturn;
+    int result = as_copy(parent->p_addrspace, &child->p_addrspace);
+    if (result) {
+        kfree(childTrapFrame);
+        fork_abort(child);
+        return result;
     }
     KASSERT(child->p_addrspace != NULL); /* Child should now have an addrspace */
     
-    int result = thread_fork("fork", child, fork_entrypoint, childTrapFrame, 0);
+    // Store the child and its pid onto its parent
+    int *childPid = kmalloc(sizeof(pid_t));
+    if (childPid == NULL) {
+        kfree(childTrapFrame);
+        fork_abort(child);
+        return ENOMEM;
+    }
+    *childPid = child->pid;
+    lock_acquire(child->exitLock);
+    result = array_add(parent->childrenPids, childPid, NULL);
+    if (result == 0) {
+        result = array_add(parent->childrenProcesses, child, NULL);
+        if (result) {
+            array_remove(parent->childrenPids, array_num(parent->childrenPids) - 1);
+        }
+    }
+    lock_release(child->exitLock);
     if (result) {
-        return result; // Not enough memory to fork, would be returning ENOMEM
+        kfree(childPid);
+        kfree(childTrapFrame);
+        fork_abort(child);
+        return result;
+    }
+    
+    result = thread_fork("fork", child, fork_entrypoint, childTrapFrame, 0);
+    if (result) {
+        // Not enough memory for the thread; the child was never seen
+        lock_acquire(child->exitLock);
+        array_remove(parent->childrenPids, array_num(parent->childrenPids) - 1);
+        array_remove(parent->childrenProcesses, array_num(parent->childrenProcesses) - 1);
+        lock_release(child->exitLock);
+        kfree(childPid);
+        kfree(childTrapFrame);
+        fork_abort(child);
+        return result;
     }
     
     *retval = child->pid;
     return(0);
 }
 
+/*
+ * Go back to the address space execv was called from, and throw away
+ * the one it was building.
+ */
+static void execv_restore(struct addrspace *old)
+{
+    struct addrspace *as = curproc_setas(old);
+    as_activate();
+    as_destroy(as);
+}
+
+/*
+ * Arguments are gathered into one ARG_MAX buffer, laid out exactly as they
+ * go on the new user stack: the argv pointers, then the strings. The
+ * buffers are big, so a couple are kept around for the next execv.
+ */
+static struct kmem_cache execv_args_cache =
+    KMEM_CACHE_INITIALIZER("execv args", ARG_MAX, NULL, NULL, 2);
+
+/*
+ * Copy the strings of the user's argv into buf, one after another, and
+ * the offset of each one into the end of buf, going backwards. Returns the
+ * number of strings in argc and the bytes they take in strLen.
+ */
+static int execv_copyin_args(char **args, char *buf, int *argc, size_t *strLen)
+{
+    uint32_t *offsets = (uint32_t *)(buf + ARG_MAX);
+    size_t used = 0;
+    int n = 0;
+
+    while (1) {
+        userptr_t arg;
+        int result = copyin((const_userptr_t)(args + n), &arg, sizeof(arg));
+        if (result) {
+            return result;
+        }
+        if (arg == NULL) {
+            break;
+        }
+
+        // Room for the string, its offset, and argv with a NULL at the end
+        size_t reserved = 2 * sizeof(uint32_t) * (n + 2);
+        if (used + reserved >= ARG_MAX) {
+            return E2BIG;
+        }
+        size_t size;
+        result = copyinstr((const_userptr_t)arg, buf + used,
+                           ARG_MAX - reserved - used, &size);
+        if (result) {
+            return result == ENAMETOOLONG ? E2BIG : result;
+        }
+        offsets[-(n + 1)] = used;
+        used += size;
+        n++;
+    }
+
+    *argc = n;
+    *strLen = used;
+    return 0;
+}
+
+/*
+ * The size of the image for argc strings taking strLen bytes.
+ */
+static size_t execv_args_size(int argc, size_t strLen)
+{
+    return ROUNDUP(sizeof(userptr_t) * (argc + 1) + strLen, 8);
+}
+
+/*
+ * Turn what execv_copyin_args left in buf into the image of the top of
+ * the new stack, for it to sit at userBase: argv, NULL, then the strings.
+ * Returns the size of the image.
+ */
+static size_t execv_layout_args(char *buf, int argc, size_t strLen, vaddr_t userBase)
+{
+    uint32_t *offsets = (uint32_t *)(buf + ARG_MAX);
+    size_t argvSize = sizeof(userptr_t) * (argc + 1);
+    userptr_t *argv = (userptr_t *)buf;
+
+    memmove(buf + argvSize, buf, strLen);
+    for (int i = 0; i < argc; i++) {
+        argv[i] = (userptr_t)(userBase + argvSize + offsets[-(i + 1)]);
+    }
+    argv[argc] = NULL;
+
+    // Pad with zeroes so the stack stays 8-aligned below the image
+    size_t imageSize = execv_args_size(argc, strLen);
+    bzero(buf + argvSize + strLen, imageSize - argvSize - strLen);
+    return imageSize;
+}
+
 int sys_execv(const char *program, char **args)
 {
     if (program == NULL || args == NULL) {
@@ -248,59 +402,55 @@ int sys_execv(const char *program, char **args)
     int result;
     
     // Move the args from the calling stack to the kernel
-    char **kernelargs = (char **)kmalloc(sizeof(char**));
-    result = copyin((const_userptr_t)args, kernelargs, sizeof(char**));
+    char *argbuf = kmem_cache_alloc(&execv_args_cache);
+    if (argbuf == NULL) {
+        return ENOMEM;
+    }
+    int argc;
+    size_t strLen;
+    result = execv_copyin_args(args, argbuf, &argc, &strLen);
     if (result) {
-        kfree(kernelargs);
+        kmem_cache_free(&execv_args_cache, argbuf);
         return result;
     }
-    int i = 0;
-    size_t size;
-    size_t totalSize = 0;
-    while (args[i] != NULL) {
-        kernelargs[i] = (char *)kmalloc(sizeof(char *) * PATH_MAX);
-        result = copyinstr((const_userptr_t)args[i], kernelargs[i], PATH_MAX, &size);
-        if (result) {
-            kfree(kernelargs);
-            return result;
-        }
-        totalSize += size;
-        i++;
-    }
-    kernelargs[i] = NULL;
-    if (totalSize > ARG_MAX) {
-        kfree(kernelargs);
-        return E2BIG;
-    }
     
     /* open the program */
-    char *program_temp;
-    program_temp = kstrdup(program);
-    result = vfs_open(program_temp, O_RDONLY, 0, &v);
+    char *program_temp = kmalloc(PATH_MAX);
+    if (program_temp == NULL) {
+        kmem_cache_free(&execv_args_cache, argbuf);
+        return ENOMEM;
+    }
+    result = copyinstr((const_userptr_t)program, program_temp, PATH_MAX, NULL);
+    if (result == 0) {
+        result = vfs_open(program_temp, O_RDONLY, 0, &v);
+    }
     kfree(program_temp);
     if (result) {
-        kfree(kernelargs);
+        kmem_cache_free(&execv_args_cache, argbuf);
         return result;
     }
     
     /* Create a new address space. */
     as = as_create();
     if (as == NULL) {
-        kfree(kernelargs);
+        kmem_cache_free(&execv_args_cache, argbuf);
         vfs_close(v);
         return ENOMEM;
     }
     
-    /* Switch to it and activate it. */
+    /*
+     * Switch to it and activate it. The old one is kept until the new
+     * one is complete, so running out of memory part way through can
+     * still return an error to the caller.
+     */
     struct addrspace *old_addrspace = curproc_setas(as);
-    as_destroy(old_addrspace);
     as_activate();
     
     /* Load the executable. */
     result = load_elf(v, &entrypoint);
     if (result) {
-        /* p_addrspace will go away when curproc is destroyed */
-        kfree(kernelargs);
+        execv_restore(old_addrspace);
+        kmem_cache_free(&execv_args_cache, argbuf);
         vfs_close(v);
         return result;
     }
@@ -311,57 +461,28 @@ int sys_execv(const char *program, char **args)
     /* Define the user stack in the address space */
     result = as_define_stack(as, &stackptr);
     if (result) {
-        /* p_addrspace will go away when curproc is destroyed */
-        kfree(kernelargs);
+        execv_restore(old_addrspace);
+        kmem_cache_free(&execv_args_cache, argbuf);
         return result;
     }
     
-    /* Put all args onto user stack */
-    i = 0;
-    while (kernelargs[i] != NULL) {
-        int length = strlen(kernelargs[i]) + 1; // get the length of the arg
-        stackptr -= length; // move the stack ptr down the length of the arg we are going to add to it
-        
-        // copy the arg onto the user stack
-        result = copyout((const void *)kernelargs[i], (userptr_t)stackptr, (size_t)length);
-        if (result) {
-            kfree(kernelargs);
-            return result;
-        }
-        
-        kernelargs[i] = (char *)stackptr; // save the user space address for the kernel arg
-        i++;
-    }
-    
-    // to start our argv array, move down until we are at a divisible by 4 address
-    int divisibleBy4 = stackptr % 4;
-    if (divisibleBy4 != 0) {
-        stackptr -= divisibleBy4;
-    }
-
-    // put argv onto the user stack
-    stackptr -= sizeof(char*); // add null terminator for argv
-    for (int j = (i - 1); j >= 0; j--) {
-        stackptr = stackptr - sizeof(char*); // move the stack ptr down 4 spots for the addr to go in
-        result = copyout((const void *) (kernelargs + j), (userptr_t) stackptr, (sizeof(char *)));
-        if (result) {
-            kfree(kernelargs);
-            return result;
-        }
+    // Put argv and the strings onto the user stack in one go
+    stackptr -= execv_args_size(argc, strLen);
+    size_t imageSize = execv_layout_args(argbuf, argc, strLen, stackptr);
+    result = copyout(argbuf, (userptr_t)stackptr, imageSize);
+    kmem_cache_free(&execv_args_cache, argbuf);
+    if (result) {
+        execv_restore(old_addrspace);
+        return result;
     }
     
-    kfree(kernelargs);
+    /* There's no going back now */
+    as_destroy(old_addrspace);
     
     vaddr_t argvstart = stackptr;
     
-    // Make sure the stack starts at an address divisible by 8
-    int divisibleBy8 = stackptr % 8;
-    if (divisibleBy8 != 0) {
-        stackptr -= divisibleBy8;
-    }
-    
     /* Warp to user mode. */
-    enter_new_process(i /*argc*/,
+    enter_new_process(argc,
                       (userptr_t)argvstart /*userspace addr of argv*/,
                       stackptr,
                       entrypoint);
@@ -0,0 +1,62 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/mman.h>
+#include <kern/unistd.h>
+#include <lib.h>
+#include <syscall.h>
+#include <current.h>
+#include <proc.h>
+#include <addrspace.h>
+
+/*
+ * mmap(), munmap() and sbrk().
+ *
+ * There is no file table yet, so the console behind the standard file
+ * descriptors is the only file a process can name. Anonymous mappings
+ * work fully; mapping the console fails in VOP_MMAP. Anything opened
+ * later can be handed to as_map the same way.
+ */
+
+int sys_mmap(userptr_t addr, size_t len, int prot, int flags, int fd,
+             off_t offset, vaddr_t *retval)
+{
+    struct vnode *v = NULL;
+
+    DEBUG(DB_SYSCALL, "Syscall: mmap(%p, %u, %d, 0x%x, %d)\n",
+          addr, len, prot, flags, fd);
+
+    if (((flags & MAP_SHARED) != 0) == ((flags & MAP_PRIVATE) != 0)) {
+        return EINVAL;
+    }
+    if ((flags & ~(MAP_SHARED | MAP_PRIVATE | MAP_FIXED | MAP_ANON)) != 0 ||
+        (prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC)) != 0) {
+        return EINVAL;
+    }
+
+    if (flags & MAP_ANON) {
+        offset = 0;
+    } else {
+        if (fd != STDIN_FILENO && fd != STDOUT_FILENO && fd != STDERR_FILENO) {
+            return EBADF;
+        }
+        KASSERT(curproc->console != NULL);
+        v = curproc->console;
+    }
+
+    return as_map(curproc_getas(), (vaddr_t)addr, len, prot, flags, v,
+                  offset, retval);
+}
+
+int sys_munmap(userptr_t addr, size_t len)
+{
+    DEBUG(DB_SYSCALL, "Syscall: munmap(%p, %u)\n", addr, len);
+
+    return as_unmap(curproc_getas(), (vaddr_t)addr, len);
+}
+
+int sys_sbrk(intptr_t amount, vaddr_t *retval)
+{
+    DEBUG(DB_SYSCALL, "Syscall: sbrk(%d)\n", (int)amount);
+
+    return as_sbrk(curproc_getas(), amount, retval);
+}
@@ -243,6 +243,10 @@ vmstats_thread(void *junk, unsigned long num)
             }
             break;
 
+          /* Leave at zero so VMSTAT_TLB_FAULT still adds up as above */
+          case VMSTAT_PAGE_FAULT_CACHED:
+            break;
+
           default:
             kprintf("Unknown stat %d\n", j);
             break;
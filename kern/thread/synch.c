@@ -33,12 +33,14 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <spinlock.h>
 #include <wchan.h>
 #include <thread.h>
 #include <current.h>
 #include <synch.h>
+#include <kmem_cache.h>
 
 ////////////////////////////////////////////////////////////
 //
@@ -146,32 +148,57 @@ V(struct semaphore *sem)
 ////////////////////////////////////////////////////////////
 //
 // Lock.
+//
+// Locks come from a kmem_cache, so a recycled one already has its wait
+// channel; only the name is new each time.
+
+static
+int
+lock_ctor(void *obj)
+{
+    struct lock *lock = obj;
+
+    lock->wchan = wchan_create("lock");
+    if (lock->wchan == NULL) {
+        return ENOMEM;
+    }
+    lock->lk_name = NULL;
+    lock->holding_thread = NULL;
+    spinlock_init(&lock->spinlock);
+    lock->lock_count = 1;
+    return 0;
+}
+
+static
+void
+lock_dtor(void *obj)
+{
+    struct lock *lock = obj;
+
+    spinlock_cleanup(&lock->spinlock);
+    wchan_destroy(lock->wchan);
+}
+
+static struct kmem_cache lock_cache =
+    KMEM_CACHE_INITIALIZER("lock", sizeof(struct lock), lock_ctor, lock_dtor,
+                           KMEM_CACHE_MAX);
 
 struct lock *
 lock_create(const char *name)
 {
     struct lock *lock;
 
-    lock = kmalloc(sizeof(struct lock));
+    lock = kmem_cache_alloc(&lock_cache);
     if (lock == NULL) {
         return NULL;
     }
 
     lock->lk_name = kstrdup(name);
     if (lock->lk_name == NULL) {
-        kfree(lock);
+        kmem_cache_free(&lock_cache, lock);
         return NULL;
     }
-
-    lock->wchan = wchan_create(lock->lk_name);
-    if (lock->wchan == NULL) {
-        kfree(lock->lk_name);
-        kfree(lock);
-        return NULL;
-    }
-
-    spinlock_init(&lock->spinlock);
-    lock->lock_count = 1;
+    wchan_setname(lock->wchan, lock->lk_name);
 
     return lock;
 }
@@ -181,11 +208,12 @@ lock_destroy(struct lock *lock)
 {
     KASSERT(lock != NULL);
     KASSERT(lock->holding_thread == NULL);
+    KASSERT(lock->lock_count == 1);
 
-    spinlock_cleanup(&lock->spinlock);
-    wchan_destroy(lock->wchan);
+    wchan_setname(lock->wchan, "lock");
     kfree(lock->lk_name);
-    kfree(lock);
+    lock->lk_name = NULL;
+    kmem_cache_free(&lock_cache, lock);
 }
 
 void
@@ -244,30 +272,52 @@ lock_do_i_hold(struct lock *lock)
 ////////////////////////////////////////////////////////////
 //
 // CV
+//
+// Cached the same way as locks.
 
+static
+int
+cv_ctor(void *obj)
+{
+    struct cv *cv = obj;
+
+    cv->cv_wchan = wchan_create("cv");
+    if (cv->cv_wchan == NULL) {
+        return ENOMEM;
+    }
+    cv->cv_name = NULL;
+    return 0;
+}
+
+static
+void
+cv_dtor(void *obj)
+{
+    struct cv *cv = obj;
+
+    wchan_destroy(cv->cv_wchan);
+}
+
+static struct kmem_cache cv_cache =
+    KMEM_CACHE_INITIALIZER("cv", sizeof(struct cv), cv_ctor, cv_dtor,
+                           KMEM_CACHE_MAX);
 
 struct cv *
 cv_create(const char *name)
 {
     struct cv *cv;
 
-    cv = kmalloc(sizeof(struct cv));
+    cv = kmem_cache_alloc(&cv_cache);
     if (cv == NULL) {
         return NULL;
     }
 
     cv->cv_name = kstrdup(name);
     if (cv->cv_name==NULL) {
-        kfree(cv);
-        return NULL;
-    }
-
-    cv->cv_wchan = wchan_create(cv->cv_name);
-    if (cv->cv_wchan == NULL) {
-        kfree(cv->cv_name);
-        kfree(cv);
+        kmem_cache_free(&cv_cache, cv);
         return NULL;
     }
+    wchan_setname(cv->cv_wchan, cv->cv_name);
 
     return cv;
 }
@@ -277,9 +327,10 @@ cv_destroy(struct cv *cv)
 {
     KASSERT(cv != NULL);
 
-    wchan_destroy(cv->cv_wchan);
+    wchan_setname(cv->cv_wchan, "cv");
     kfree(cv->cv_name);
-    kfree(cv);
+    cv->cv_name = NULL;
+    kmem_cache_free(&cv_cache, cv);
 }
 
 void
@@ -48,8 +48,10 @@
 #include <current.h>
 #include <synch.h>
 #include <addrspace.h>
+#include <vm.h>
 #include <mainbus.h>
 #include <vnode.h>
+#include <kmem_cache.h>
 
 #include "opt-synchprobs.h"
 
@@ -111,9 +113,42 @@ thread_checkstack(struct thread *thread)
 	}
 }
 
+/*
+ * Thread structures are recycled through a kmem_cache along with their
+ * stacks, so a forked thread usually gets a stack that is already
+ * allocated and warm in the cache. Each cached thread holds on to a
+ * page of stack, so only a few are kept.
+ */
+static
+int
+thread_ctor(void *obj)
+{
+	struct thread *thread = obj;
+
+	thread->t_stack = NULL;
+	return 0;
+}
+
+static
+void
+thread_dtor(void *obj)
+{
+	struct thread *thread = obj;
+
+	if (thread->t_stack != NULL) {
+		kfree(thread->t_stack);
+	}
+}
+
+static struct kmem_cache thread_cache =
+	KMEM_CACHE_INITIALIZER("thread", sizeof(struct thread),
+			       thread_ctor, thread_dtor, 4);
+
 /*
  * Create a thread. This is used both to create a first thread
  * for each CPU and to create subsequent forked threads.
+ *
+ * The thread may come with a stack from its last use.
  */
 static
 struct thread *
@@ -123,14 +158,14 @@ thread_create(const char *name)
 
 	DEBUGASSERT(name != NULL);
 
-	thread = kmalloc(sizeof(*thread));
+	thread = kmem_cache_alloc(&thread_cache);
 	if (thread == NULL) {
 		return NULL;
 	}
 
 	thread->t_name = kstrdup(name);
 	if (thread->t_name == NULL) {
-		kfree(thread);
+		kmem_cache_free(&thread_cache, thread);
 		return NULL;
 	}
 	thread->t_wchan_name = "NEW";
@@ -139,7 +174,6 @@ thread_create(const char *name)
 	/* Thread subsystem fields */
 	thread_machdep_init(&thread->t_machdep);
 	threadlistnode_init(&thread->t_listnode, thread);
-	thread->t_stack = NULL;
 	thread->t_context = NULL;
 	thread->t_cpu = NULL;
 	thread->t_proc = NULL;
@@ -168,6 +202,7 @@ cpu_create(unsigned hardware_number)
 	struct cpu *c;
 	int result;
 	char namebuf[16];
+	unsigned i;
 
 	c = kmalloc(sizeof(*c));
 	if (c == NULL) {
@@ -180,6 +215,19 @@ cpu_create(unsigned hardware_number)
 	c->c_curthread = NULL;
 	threadlist_init(&c->c_zombies);
 	c->c_hardclocks = 0;
+	c->c_tlb_hand = 0;
+	c->c_tlb_as = NULL;
+	for (i=0; i<VMSTAT_COUNT; i++) {
+		c->c_vmstats[i] = 0;
+	}
+	c->c_stlb_hits = 0;
+	c->c_stlb_misses = 0;
+	c->c_stlb_preloads = 0;
+	c->c_stlb_faultarounds = 0;
+	c->c_stlb_faultaround_misses = 0;
+	c->c_shootdowns = 0;
+	c->c_shootdown_ipis = 0;
+	c->c_shootdown_flushes = 0;
 
 	c->c_isidle = false;
 	threadlist_init(&c->c_runqueue);
@@ -187,8 +235,23 @@ cpu_create(unsigned hardware_number)
 
 	c->c_ipi_pending = 0;
 	c->c_numshootdown = 0;
+	c->c_shootdownseq = 0;
 	spinlock_init(&c->c_ipi_lock);
 
+	c->c_pagecache_count = 0;
+	c->c_pagecache_hits = 0;
+	c->c_pagecache_misses = 0;
+	c->c_pagecache_frees = 0;
+	c->c_pagecache_drains = 0;
+	spinlock_init(&c->c_pagecache_lock);
+
+	for (i=0; i<CPU_KMALLOC_NSIZES; i++) {
+		c->c_kmalloc_loaded[i] = NULL;
+		c->c_kmalloc_previous[i] = NULL;
+	}
+	c->c_kmalloc_hits = 0;
+	c->c_kmalloc_misses = 0;
+
 	result = cpuarray_add(&allcpus, c, &c->c_number);
 	if (result != 0) {
 		panic("cpu_create: array_add: %s\n", strerror(result));
@@ -212,9 +275,12 @@ cpu_create(unsigned hardware_number)
 		 * make it possible to free the boot stack?)
 		 */
 		/*c->c_curthread->t_stack = ... */
+		KASSERT(c->c_curthread->t_stack == NULL);
 	}
 	else {
-		c->c_curthread->t_stack = kmalloc(STACK_SIZE);
+		if (c->c_curthread->t_stack == NULL) {
+			c->c_curthread->t_stack = kmalloc(STACK_SIZE);
+		}
 		if (c->c_curthread->t_stack == NULL) {
 			panic("cpu_create: couldn't allocate stack");
 		}
@@ -227,6 +293,22 @@ cpu_create(unsigned hardware_number)
 	return c;
 }
 
+/*
+ * Number of cpus, and the cpu with a given software number.
+ */
+unsigned
+cpu_count(void)
+{
+	return cpuarray_num(&allcpus);
+}
+
+struct cpu *
+cpu_get(unsigned number)
+{
+	KASSERT(number < cpuarray_num(&allcpus));
+	return cpuarray_get(&allcpus, number);
+}
+
 /*
  * Destroy a thread.
  *
@@ -249,17 +331,15 @@ thread_destroy(struct thread *thread)
 
 	/* Thread subsystem fields */
 	KASSERT(thread->t_proc == NULL);
-	if (thread->t_stack != NULL) {
-		kfree(thread->t_stack);
-	}
 	threadlistnode_cleanup(&thread->t_listnode);
 	thread_machdep_cleanup(&thread->t_machdep);
 
 	/* sheer paranoia */
 	thread->t_wchan_name = "DESTROYED";
 
+	/* The stack stays with the structure in the cache */
 	kfree(thread->t_name);
-	kfree(thread);
+	kmem_cache_free(&thread_cache, thread);
 }
 
 /*
@@ -492,8 +572,10 @@ thread_fork(const char *name,
 		return ENOMEM;
 	}
 
-	/* Allocate a stack */
-	newthread->t_stack = kmalloc(STACK_SIZE);
+	/* Allocate a stack, unless it came with one */
+	if (newthread->t_stack == NULL) {
+		newthread->t_stack = kmalloc(STACK_SIZE);
+	}
 	if (newthread->t_stack == NULL) {
 		thread_destroy(newthread);
 		return ENOMEM;
@@ -635,7 +717,10 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 		next = threadlist_remhead(&curcpu->c_runqueue);
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
-			cpu_idle();
+			/* Give the VM system a chance to do background work */
+			if (!vm_idle()) {
+				cpu_idle();
+			}
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
 	} while (next == NULL);
@@ -998,6 +1083,17 @@ wchan_destroy(struct wchan *wc)
 	kfree(wc);
 }
 
+/*
+ * Rename a wait channel. Nobody can be sleeping on it while this
+ * happens, or they'd be shown under the wrong name.
+ */
+void
+wchan_setname(struct wchan *wc, const char *name)
+{
+	KASSERT(wchan_isempty(wc));
+	wc->wc_name = name;
+}
+
 /*
  * Lock and unlock a wait channel, respectively.
  */
@@ -1140,15 +1236,24 @@ ipi_broadcast(int code)
 	}
 }
 
-void
-ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
+/*
+ * Queue a shootdown on TARGET; the caller pokes it afterwards. Returns
+ * the batch number the shootdown will be handled in. Call with the
+ * target's IPI lock held.
+ */
+static
+unsigned
+ipi_tlbshootdown_queue(struct cpu *target, const struct tlbshootdown *mapping)
 {
 	int n;
 
-	spinlock_acquire(&target->c_ipi_lock);
+	KASSERT(spinlock_do_i_hold(&target->c_ipi_lock));
 
 	n = target->c_numshootdown;
-	if (n == TLBSHOOTDOWN_MAX) {
+	if (n == TLBSHOOTDOWN_ALL) {
+		/* already flushing everything */
+	}
+	else if (n == TLBSHOOTDOWN_MAX) {
 		target->c_numshootdown = TLBSHOOTDOWN_ALL;
 	}
 	else {
@@ -1157,9 +1262,51 @@ ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 	}
 
 	target->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
+
+	return target->c_shootdownseq;
+}
+
+void
+ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
+{
+	spinlock_acquire(&target->c_ipi_lock);
+	ipi_tlbshootdown_queue(target, mapping);
 	mainbus_send_ipi(target);
+	spinlock_release(&target->c_ipi_lock);
+}
+
+void
+ipi_tlbshootdown_wait(struct cpu *target, const struct tlbshootdown *mappings,
+		      unsigned n)
+{
+	unsigned seq, i;
+	bool done;
 
+	KASSERT(curthread->t_curspl == 0);
+	KASSERT(n > 0);
+
+	spinlock_acquire(&target->c_ipi_lock);
+	if (n > TLBSHOOTDOWN_MAX) {
+		target->c_numshootdown = TLBSHOOTDOWN_ALL;
+		n = 1;
+	}
+	seq = 0;
+	for (i=0; i<n; i++) {
+		seq = ipi_tlbshootdown_queue(target, &mappings[i]);
+	}
+	/* One interrupt for the whole batch */
+	mainbus_send_ipi(target);
 	spinlock_release(&target->c_ipi_lock);
+
+	/*
+	 * Spin with interrupts on, so that if the target is at the
+	 * same time waiting on us we still take its IPI.
+	 */
+	do {
+		spinlock_acquire(&target->c_ipi_lock);
+		done = target->c_shootdownseq != seq;
+		spinlock_release(&target->c_ipi_lock);
+	} while (!done);
 }
 
 void
@@ -1202,6 +1349,7 @@ interprocessor_interrupt(void)
 			}
 		}
 		curcpu->c_numshootdown = 0;
+		curcpu->c_shootdownseq++;
 	}
 
 	curcpu->c_ipi_pending = 0;
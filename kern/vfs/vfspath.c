@@ -38,6 +38,10 @@
 #include <lib.h>
 #include <vfs.h>
 #include <vnode.h>
+#include "opt-dumbvm.h"
+#if !OPT_DUMBVM
+#include <pagecache.h>
+#endif
 
 
 /* Does most of the work for open(). */
@@ -94,6 +98,13 @@ vfs_open(char *path, int openflags, mode_t mode, struct vnode **ret)
 	}
 
 	VOP_INCOPEN(vn);
+
+#if !OPT_DUMBVM
+	/* Pages cached from the old contents would go stale */
+	if (canwrite) {
+		pagecache_invalidate(vn);
+	}
+#endif
 	
 	if (openflags & O_TRUNC) {
 		if (canwrite==0) {
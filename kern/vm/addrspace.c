@@ -0,0 +1,1097 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#define ASINLINE
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/mman.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <spl.h>
+#include <proc.h>
+#include <cpu.h>
+#include <current.h>
+#include <mips/tlb.h>
+#include <uio.h>
+#include <vnode.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <coremap.h>
+#include <swap.h>
+#include "opt-A3.h"
+
+/*
+ * Address spaces for the paging VM system.
+ *
+ * An address space is a sorted array of regions: the segments loaded
+ * from the executable, the heap, the stack, and anything mmapped. The regions only
+ * say what may be mapped and where it comes from; which frame backs each
+ * page is kept in a two-level page table, whose second level tables are
+ * only allocated once a page they cover is touched.
+ *
+ * Resident pages can be evicted by the pager at any time, so page table
+ * entries are read under as_lock, and a page that is busy being evicted
+ * is waited for and then looked at again.
+ */
+
+static
+struct region *
+region_create(vaddr_t vbase, size_t npages, bool writeable)
+{
+    struct region *rg = kmalloc(sizeof(struct region));
+    if (rg == NULL) {
+        return NULL;
+    }
+    
+    rg->rg_vbase = vbase;
+    rg->rg_npages = npages;
+    rg->rg_writeable = writeable;
+    rg->rg_shared = false;
+    rg->rg_mapped = false;
+    rg->rg_vnode = NULL;
+    rg->rg_filevaddr = 0;
+    rg->rg_fileoffset = 0;
+    rg->rg_filesize = 0;
+    return rg;
+}
+
+static
+void
+region_destroy(struct region *rg)
+{
+    if (rg->rg_vnode != NULL) {
+        VOP_DECREF(rg->rg_vnode);
+    }
+    kfree(rg);
+}
+
+/*
+ * Return the index of the first region in AS that starts above VADDR.
+ */
+static
+unsigned
+as_region_upper(struct addrspace *as, vaddr_t vaddr)
+{
+    unsigned lo = 0;
+    unsigned hi = regionarray_num(as->as_regions);
+    
+    while (lo < hi) {
+        unsigned mid = lo + (hi - lo) / 2;
+        if (regionarray_get(as->as_regions, mid)->rg_vbase <= vaddr) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/*
+ * Add a region of NPAGES pages at VBASE to AS, keeping the array sorted.
+ * Fails with EINVAL if it would overlap a region that's already there.
+ */
+static
+int
+as_add_region(struct addrspace *as, vaddr_t vbase, size_t npages,
+              bool writeable, struct region **ret)
+{
+    struct region *rg, *neighbour;
+    unsigned i, num;
+    int result;
+    
+    KASSERT((vbase & PAGE_FRAME) == vbase);
+    if (npages == 0 || vbase + npages * PAGE_SIZE > USERSPACETOP ||
+        vbase + npages * PAGE_SIZE < vbase) {
+        return EINVAL;
+    }
+    
+    i = as_region_upper(as, vbase);
+    num = regionarray_num(as->as_regions);
+    if (i > 0) {
+        neighbour = regionarray_get(as->as_regions, i - 1);
+        if (neighbour->rg_vbase + neighbour->rg_npages * PAGE_SIZE > vbase) {
+            return EINVAL;
+        }
+    }
+    if (i < num) {
+        neighbour = regionarray_get(as->as_regions, i);
+        if (vbase + npages * PAGE_SIZE > neighbour->rg_vbase) {
+            return EINVAL;
+        }
+    }
+    
+    rg = region_create(vbase, npages, writeable);
+    if (rg == NULL) {
+        return ENOMEM;
+    }
+    
+    /* Grow the array by one and slide everything from I up */
+    result = regionarray_setsize(as->as_regions, num + 1);
+    if (result) {
+        kfree(rg);
+        return result;
+    }
+    for (unsigned k = num; k > i; k--) {
+        regionarray_set(as->as_regions, k,
+                        regionarray_get(as->as_regions, k - 1));
+    }
+    regionarray_set(as->as_regions, i, rg);
+    
+    if (ret != NULL) {
+        *ret = rg;
+    }
+    return 0;
+}
+
+/*
+ * Return the lowest address at or above START with room for NPAGES
+ * pages between the regions of AS, or 0 if there isn't one.
+ */
+static
+vaddr_t
+as_find_gap(struct addrspace *as, vaddr_t start, size_t npages)
+{
+    vaddr_t base = start;
+    size_t len = npages * PAGE_SIZE;
+    
+    for (unsigned i = 0; i < regionarray_num(as->as_regions); i++) {
+        struct region *rg = regionarray_get(as->as_regions, i);
+        vaddr_t end = rg->rg_vbase + rg->rg_npages * PAGE_SIZE;
+        
+        if (end <= base) {
+            continue;
+        }
+        if (rg->rg_vbase >= base + len) {
+            break;
+        }
+        base = end;
+    }
+    
+    /* Leave room for the stack to grow */
+    if (base + len > USERSTACK - VM_STACKLIMIT || base + len < base) {
+        return 0;
+    }
+    return base;
+}
+
+static
+paddr_t *
+pt_create_table(void)
+{
+    paddr_t *table = kmalloc(PT_L2ENTRIES * sizeof(paddr_t));
+    if (table == NULL) {
+        return NULL;
+    }
+    for (unsigned i = 0; i < PT_L2ENTRIES; i++) {
+        table[i] = 0;
+    }
+    return table;
+}
+
+/*
+ * Drop the page at *PTEP, which belongs to AS, and clear the entry.
+ */
+static
+void
+pt_drop_entry(struct addrspace *as, paddr_t *ptep)
+{
+    paddr_t pte;
+    
+    while (true) {
+        spinlock_acquire(&as->as_lock);
+        pte = *ptep;
+        if (PTE_ISRESIDENT(pte) && !cm_page_decref(pte, as)) {
+            /* Being paged out; wait for it to land in swap */
+            spinlock_release(&as->as_lock);
+            cm_page_waitbusy(pte);
+            continue;
+        }
+        *ptep = 0;
+        spinlock_release(&as->as_lock);
+        break;
+    }
+    
+    if (PTE_ISSWAPPED(pte)) {
+        swap_free(PTE_SWAPSLOT(pte));
+    }
+}
+
+/*
+ * Drop every page in the second level table L1 of AS, then free the
+ * table. The pager may be searching it in as_reverse_lookup, so it's
+ * taken out of the first level table under as_lock before it goes.
+ */
+static
+void
+pt_destroy_table(struct addrspace *as, unsigned l1)
+{
+    paddr_t *table = as->as_pagetable[l1];
+    
+    for (unsigned i = 0; i < PT_L2ENTRIES; i++) {
+        pt_drop_entry(as, &table[i]);
+    }
+    
+    spinlock_acquire(&as->as_lock);
+    as->as_pagetable[l1] = NULL;
+    spinlock_release(&as->as_lock);
+    kfree(table);
+}
+
+/*
+ * Make NEW a copy of the second level table OLD, which belongs to
+ * OLDAS. Resident pages are shared copy-on-write rather than copied;
+ * vm_fault gives each side its own copy on the first write. Pages in
+ * swap get a swap slot of their own. Pages that were never touched stay
+ * that way and will be paged in by the child.
+ */
+static
+int
+pt_copy_table(struct addrspace *oldas, const paddr_t *old, paddr_t *new)
+{
+    paddr_t pte;
+    uint32_t slot;
+    int result;
+    
+    unsigned i = 0;
+    while (i < PT_L2ENTRIES) {
+        spinlock_acquire(&oldas->as_lock);
+        pte = old[i];
+        if (PTE_ISRESIDENT(pte) && !cm_page_incref(pte)) {
+            /* Being paged out; wait for it to land in swap */
+            spinlock_release(&oldas->as_lock);
+            cm_page_waitbusy(pte);
+            continue;
+        }
+        spinlock_release(&oldas->as_lock);
+        
+        if (PTE_ISRESIDENT(pte)) {
+            new[i] = pte;
+        }
+        else if (PTE_ISSWAPPED(pte)) {
+            /* Only our own faults take pages out of swap, so PTE is stable */
+            result = swap_copy(PTE_SWAPSLOT(pte), &slot);
+            if (result) {
+                return result;
+            }
+            new[i] = PTE_FROMSLOT(slot);
+        }
+        i++;
+    }
+    return 0;
+}
+
+/*
+ * Write the changed pages of the shared mapping RG back to its file.
+ * They stay marked dirty, since another process may still be writing
+ * to them. Returns the first error, but carries on past it.
+ */
+static
+int
+as_sync_region(struct addrspace *as, struct region *rg)
+{
+    struct iovec iov;
+    struct uio u;
+    vaddr_t vaddr, from, to;
+    paddr_t *ptep, pte;
+    int result, err = 0;
+    
+    KASSERT(rg->rg_shared);
+    
+    for (size_t i = 0; i < rg->rg_npages; i++) {
+        vaddr = rg->rg_vbase + i * PAGE_SIZE;
+        if (!as_region_fileslice(rg, vaddr, &from, &to)) {
+            continue;
+        }
+        ptep = as_lookup_pte(as, vaddr, false);
+        if (ptep == NULL) {
+            continue;
+        }
+        
+        spinlock_acquire(&as->as_lock);
+        pte = *ptep;
+        spinlock_release(&as->as_lock);
+        
+        /* The page cache holds these pages too, so they can't be evicted */
+        if (!PTE_ISRESIDENT(pte) || !cm_page_isdirty(pte)) {
+            continue;
+        }
+        
+        uio_kinit(&iov, &u, (char *)PADDR_TO_KVADDR(pte) + (from - vaddr),
+                  to - from, rg->rg_fileoffset + (from - rg->rg_filevaddr),
+                  UIO_WRITE);
+        result = VOP_WRITE(rg->rg_vnode, &u);
+        if (result && err == 0) {
+            err = result;
+        }
+    }
+    return err;
+}
+
+/*
+ * Return the page table entry for VADDR. If its second level table
+ * hasn't been allocated yet, allocate it if CREATE is set and otherwise
+ * return NULL. Also returns NULL if out of memory.
+ *
+ * Tables are only added by the address space's own thread, and the
+ * pager only looks up pages that are resident, so the lookup doesn't
+ * need as_lock.
+ */
+paddr_t *
+as_lookup_pte(struct addrspace *as, vaddr_t vaddr, bool create)
+{
+    unsigned l1 = PT_L1INDEX(vaddr);
+    paddr_t *table;
+    
+    KASSERT(vaddr < USERSPACETOP);
+    
+    table = as->as_pagetable[l1];
+    if (table == NULL) {
+        if (!create) {
+            return NULL;
+        }
+        table = pt_create_table();
+        if (table == NULL) {
+            return NULL;
+        }
+        as->as_pagetable[l1] = table;
+    }
+    return &table[PT_L2INDEX(vaddr)];
+}
+
+/*
+ * The coremap only records who owns a page, so the pager finds where it
+ * is mapped by searching the owner's page table. That costs a walk over
+ * the tables in use, but only once per eviction or move, next to a disk
+ * write or a page copy. The page is busy, so its entry can't change
+ * under us, and as_destroy can't free the table it is in until we're
+ * done. Any other table may be going away at the same time, so each one
+ * is searched holding as_lock, which pt_destroy_table needs to take it
+ * out of the first level table.
+ */
+vaddr_t
+as_reverse_lookup(struct addrspace *as, paddr_t paddr)
+{
+    paddr_t *table;
+    
+    for (unsigned l1 = 0; l1 < PT_L1ENTRIES; l1++) {
+        spinlock_acquire(&as->as_lock);
+        table = as->as_pagetable[l1];
+        if (table != NULL) {
+            for (unsigned l2 = 0; l2 < PT_L2ENTRIES; l2++) {
+                if (table[l2] == paddr) {
+                    spinlock_release(&as->as_lock);
+                    return ((vaddr_t)l1 << 22) | ((vaddr_t)l2 << 12);
+                }
+            }
+        }
+        spinlock_release(&as->as_lock);
+    }
+    panic("as_reverse_lookup: paddr 0x%x isn't mapped\n", paddr);
+}
+
+/*
+ * Software TLB.
+ */
+
+static
+struct stlb_entry *
+as_stlb_slot(struct addrspace *as, vaddr_t vaddr)
+{
+    return &as->as_stlb[(vaddr / PAGE_SIZE) % AS_STLB_SIZE];
+}
+
+bool
+as_stlb_lookup(struct addrspace *as, vaddr_t vaddr, uint32_t *elo)
+{
+    struct stlb_entry *se = as_stlb_slot(as, vaddr);
+    bool hit;
+    
+    KASSERT(spinlock_do_i_hold(&as->as_lock));
+    
+    hit = se->se_elo != 0 && se->se_vaddr == vaddr;
+    if (hit) {
+        *elo = se->se_elo;
+        se->se_hits++;
+    }
+    
+    if (hit) {
+        curcpu->c_stlb_hits++;
+        if (se->se_faultaround) {
+            /* Pushed out again before it saved us a miss */
+            curcpu->c_stlb_faultaround_misses++;
+        }
+        se->se_faultaround = false;
+    }
+    else {
+        curcpu->c_stlb_misses++;
+    }
+    return hit;
+}
+
+void
+as_stlb_insert(struct addrspace *as, vaddr_t vaddr, uint32_t elo)
+{
+    struct stlb_entry *se = as_stlb_slot(as, vaddr);
+    
+    KASSERT(spinlock_do_i_hold(&as->as_lock));
+    
+    if (se->se_elo == 0 || se->se_vaddr != vaddr) {
+        se->se_vaddr = vaddr;
+        se->se_hits = 0;
+    }
+    se->se_elo = elo;
+    se->se_hits++;
+    se->se_faultaround = false;
+}
+
+/*
+ * Record that VADDR went into the TLB ahead of any miss on it. There's
+ * no reference bit to tell whether it gets used, so we count it as used
+ * unless it has to be refilled anyway.
+ */
+void
+as_stlb_faultaround(struct addrspace *as, vaddr_t vaddr, uint32_t elo)
+{
+    struct stlb_entry *se = as_stlb_slot(as, vaddr);
+    
+    KASSERT(spinlock_do_i_hold(&as->as_lock));
+    
+    if (se->se_elo == 0 || se->se_vaddr != vaddr) {
+        se->se_vaddr = vaddr;
+        se->se_hits = 0;
+    }
+    se->se_elo = elo;
+    se->se_faultaround = true;
+    curcpu->c_stlb_faultarounds++;
+}
+
+/*
+ * Whether VADDR has had to be refilled more than once lately, which
+ * means it keeps getting pushed out of the TLB while it's in use. Each
+ * call uses up one refill's worth of that, so nothing is hot forever.
+ */
+bool
+as_stlb_hot(struct addrspace *as, vaddr_t vaddr)
+{
+    struct stlb_entry *se = as_stlb_slot(as, vaddr);
+    
+    KASSERT(spinlock_do_i_hold(&as->as_lock));
+    
+    if (se->se_elo == 0 || se->se_vaddr != vaddr || se->se_hits < 2) {
+        return false;
+    }
+    se->se_hits--;
+    return true;
+}
+
+void
+as_stlb_invalidate(struct addrspace *as, vaddr_t vaddr)
+{
+    struct stlb_entry *se = as_stlb_slot(as, vaddr);
+    
+    KASSERT(spinlock_do_i_hold(&as->as_lock));
+    
+    if (se->se_vaddr == vaddr) {
+        se->se_elo = 0;
+    }
+}
+
+static
+void
+as_stlb_flush(struct addrspace *as)
+{
+    KASSERT(spinlock_do_i_hold(&as->as_lock));
+    
+    for (unsigned i = 0; i < AS_STLB_SIZE; i++) {
+        as->as_stlb[i].se_elo = 0;
+    }
+}
+
+/*
+ * Put the entries that were refilled recently back in the TLB, which
+ * has just been flushed, and age the rest.
+ */
+static
+void
+as_stlb_preload(struct addrspace *as)
+{
+    struct stlb_entry *se;
+    unsigned slot = 0;
+    
+    spinlock_acquire(&as->as_lock);
+    for (unsigned i = 0; i < AS_STLB_SIZE; i++) {
+        se = &as->as_stlb[i];
+        if (se->se_elo != 0 && se->se_hits > 0 && slot < AS_STLB_PRELOAD) {
+            tlb_write(se->se_vaddr, se->se_elo, slot++);
+        }
+        se->se_hits /= 2;
+    }
+    curcpu->c_stlb_preloads += slot;
+    spinlock_release(&as->as_lock);
+    
+    /* Refills go after the preloaded entries */
+    curcpu->c_tlb_hand = slot % NUM_TLB;
+}
+
+void
+as_stlb_printstats(void)
+{
+    unsigned hits = 0, misses = 0, preloads = 0;
+    unsigned faultarounds = 0, faultaroundMisses = 0;
+    
+    for (unsigned i = 0; i < cpu_count(); i++) {
+        struct cpu *c = cpu_get(i);
+        hits += c->c_stlb_hits;
+        misses += c->c_stlb_misses;
+        preloads += c->c_stlb_preloads;
+        faultarounds += c->c_stlb_faultarounds;
+        faultaroundMisses += c->c_stlb_faultaround_misses;
+    }
+    kprintf("VM: software TLB hits %u of %u refills, %u entries preloaded\n",
+            hits, hits + misses, preloads);
+    kprintf("VM: fault-around entered %u pages, %u used, %u missed anyway\n",
+            faultarounds, faultarounds - faultaroundMisses,
+            faultaroundMisses);
+}
+
+struct addrspace *
+as_create(void)
+{
+    struct addrspace *as = kmalloc(sizeof(struct addrspace));
+    if (as==NULL) {
+        return NULL;
+    }
+    
+    as->as_regions = regionarray_create();
+    if (as->as_regions == NULL) {
+        kfree(as);
+        return NULL;
+    }
+    as->as_stack = NULL;
+    as->as_heap = NULL;
+    as->as_heapbase = 0;
+    as->as_heapend = 0;
+    
+    as->as_pagetable = kmalloc(PT_L1ENTRIES * sizeof(paddr_t *));
+    if (as->as_pagetable == NULL) {
+        regionarray_destroy(as->as_regions);
+        kfree(as);
+        return NULL;
+    }
+    for (unsigned l1 = 0; l1 < PT_L1ENTRIES; l1++) {
+        as->as_pagetable[l1] = NULL;
+    }
+    for (unsigned i = 0; i < AS_STLB_SIZE; i++) {
+        as->as_stlb[i].se_vaddr = 0;
+        as->as_stlb[i].se_elo = 0;
+        as->as_stlb[i].se_hits = 0;
+        as->as_stlb[i].se_faultaround = false;
+    }
+    if (cm_owner_register(as, &as->as_cmowner)) {
+        kfree(as->as_pagetable);
+        regionarray_destroy(as->as_regions);
+        kfree(as);
+        return NULL;
+    }
+    spinlock_init(&as->as_lock);
+    
+    return as;
+}
+
+void
+as_destroy(struct addrspace *as)
+{
+    /* Nobody is left to call munmap, so write shared mappings back now */
+    for (unsigned i = 0; i < regionarray_num(as->as_regions); i++) {
+        struct region *rg = regionarray_get(as->as_regions, i);
+        if (rg->rg_shared) {
+            as_sync_region(as, rg);
+        }
+    }
+    
+    for (unsigned l1 = 0; l1 < PT_L1ENTRIES; l1++) {
+        if (as->as_pagetable[l1] != NULL) {
+            pt_destroy_table(as, l1);
+        }
+    }
+    kfree(as->as_pagetable);
+    
+    for (unsigned i = 0; i < regionarray_num(as->as_regions); i++) {
+        region_destroy(regionarray_get(as->as_regions, i));
+    }
+    regionarray_setsize(as->as_regions, 0);
+    regionarray_destroy(as->as_regions);
+    
+    cm_owner_unregister(as->as_cmowner);
+    spinlock_cleanup(&as->as_lock);
+    kfree(as);
+}
+
+void
+as_activate(void)
+{
+    int i, spl;
+    struct addrspace *as;
+    
+    as = curproc_getas();
+    if (as == NULL) {
+        /* Kernel threads don't have an address spaces to activate */
+        return;
+    }
+    
+    /* Disable interrupts on this CPU while frobbing the TLB. */
+    spl = splhigh();
+    
+    for (i=0; i<NUM_TLB; i++) {
+        tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+    }
+    curcpu->c_tlb_hand = 0;
+    curcpu->c_tlb_as = as;
+    
+    if (AS_STLB_PRELOAD > 0) {
+        as_stlb_preload(as);
+    }
+    
+    splx(spl);
+}
+
+void
+as_deactivate(void)
+{
+    /* nothing */
+}
+
+int
+as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
+                 int readable, int writeable, int executable)
+{
+    int result;
+    
+    /* Align the region. First, the base... */
+    sz += vaddr & ~(vaddr_t)PAGE_FRAME;
+    vaddr &= PAGE_FRAME;
+    
+    /* ...and now the length. */
+    sz = (sz + PAGE_SIZE - 1) & PAGE_FRAME;
+    
+    /* Everything mapped is readable, and we don't enforce execute */
+    (void)readable;
+    (void)executable;
+    
+    result = as_add_region(as, vaddr, sz / PAGE_SIZE, writeable != 0, NULL);
+    if (result == EINVAL) {
+        kprintf("vm: Warning: bad region at 0x%lx\n", (unsigned long)vaddr);
+    }
+    return result;
+}
+
+int
+as_prepare_load(struct addrspace *as)
+{
+    /* Nothing to do; page tables and pages are allocated as they're touched */
+    (void)as;
+    return 0;
+}
+
+int
+as_complete_load(struct addrspace *as)
+{
+    unsigned num = regionarray_num(as->as_regions);
+    struct region *last;
+    
+    /* The heap starts empty, right after the last segment */
+    KASSERT(as->as_heap == NULL);
+    if (num > 0) {
+        last = regionarray_get(as->as_regions, num - 1);
+        as->as_heapbase = last->rg_vbase + last->rg_npages * PAGE_SIZE;
+    }
+    as->as_heapend = as->as_heapbase;
+    return 0;
+}
+
+int
+as_define_stack(struct addrspace *as, vaddr_t *stackptr)
+{
+    int result;
+    
+    KASSERT(as->as_stack == NULL);
+    result = as_add_region(as, USERSTACK - VM_STACKPAGES * PAGE_SIZE,
+                           VM_STACKPAGES, true, &as->as_stack);
+    if (result) {
+        return result;
+    }
+    
+    *stackptr = USERSTACK;
+    return 0;
+}
+
+int
+as_define_backing(struct addrspace *as, struct vnode *v,
+                  off_t offset, vaddr_t vaddr, size_t filesize)
+{
+    struct region *rg = as_find_region(as, vaddr);
+    if (rg == NULL || rg == as->as_stack) {
+        return EFAULT;
+    }
+    
+    rg->rg_filevaddr = vaddr;
+    rg->rg_fileoffset = offset;
+    rg->rg_filesize = filesize;
+    
+    /* Hold on to the executable for as long as its pages might be needed */
+    if (rg->rg_vnode == NULL) {
+        VOP_INCREF(v);
+        rg->rg_vnode = v;
+    }
+    KASSERT(rg->rg_vnode == v);
+    return 0;
+}
+
+struct region *
+as_find_region(struct addrspace *as, vaddr_t vaddr)
+{
+    struct region *rg;
+    unsigned i;
+    
+    /* The region we want, if any, is the last one starting at or below */
+    i = as_region_upper(as, vaddr);
+    if (i == 0) {
+        return NULL;
+    }
+    rg = regionarray_get(as->as_regions, i - 1);
+    if (vaddr - rg->rg_vbase < rg->rg_npages * PAGE_SIZE) {
+        return rg;
+    }
+    return NULL;
+}
+
+/*
+ * Give back the NPAGES pages from VBASE on, which belong to the current
+ * process. Their region has to stop covering them afterwards.
+ */
+static
+void
+as_drop_pages(struct addrspace *as, vaddr_t vbase, size_t npages)
+{
+    paddr_t *ptep;
+    
+    for (size_t k = 0; k < npages; k++) {
+        vaddr_t va = vbase + k * PAGE_SIZE;
+        
+        ptep = as_lookup_pte(as, va, false);
+        if (ptep != NULL) {
+            pt_drop_entry(as, ptep);
+        }
+        spinlock_acquire(&as->as_lock);
+        as_stlb_invalidate(as, va);
+        spinlock_release(&as->as_lock);
+    }
+    
+    vm_tlbshootdown_pages(as, vbase, npages);
+}
+
+struct region *
+as_grow_stack(struct addrspace *as, vaddr_t vaddr)
+{
+    struct region *stack = as->as_stack;
+    struct region *below;
+    unsigned i;
+    
+    vaddr &= PAGE_FRAME;
+    if (stack == NULL || vaddr >= stack->rg_vbase ||
+        vaddr < USERSTACK - VM_STACKLIMIT) {
+        return NULL;
+    }
+    
+    /* It can't grow past, or into, anything mapped below it */
+    i = as_region_upper(as, vaddr);
+    if (regionarray_get(as->as_regions, i) != stack) {
+        return NULL;
+    }
+    if (i > 0) {
+        below = regionarray_get(as->as_regions, i - 1);
+        if (below->rg_vbase + below->rg_npages * PAGE_SIZE > vaddr) {
+            return NULL;
+        }
+    }
+    
+    stack->rg_npages += (stack->rg_vbase - vaddr) / PAGE_SIZE;
+    stack->rg_vbase = vaddr;
+    return stack;
+}
+
+bool
+as_region_fileslice(struct region *rg, vaddr_t vaddr,
+                    vaddr_t *from, vaddr_t *to)
+{
+    *from = vaddr;
+    *to = vaddr + PAGE_SIZE;
+    if (*from < rg->rg_filevaddr) {
+        *from = rg->rg_filevaddr;
+    }
+    if (*to > rg->rg_filevaddr + rg->rg_filesize) {
+        *to = rg->rg_filevaddr + rg->rg_filesize;
+    }
+    
+    return rg->rg_vnode != NULL && rg->rg_filesize != 0 && *from < *to;
+}
+
+int
+as_map(struct addrspace *as, vaddr_t vaddr, size_t len, int prot, int flags,
+       struct vnode *v, off_t offset, vaddr_t *ret)
+{
+    struct region *rg;
+    struct stat st;
+    size_t npages;
+    int result;
+    
+    if (len == 0 || offset < 0 || (offset & ~(off_t)PAGE_FRAME) != 0) {
+        return EINVAL;
+    }
+    if (len > USERSPACETOP) {
+        return ENOMEM;
+    }
+    npages = DIVROUNDUP(len, PAGE_SIZE);
+    
+    if (v != NULL) {
+        result = VOP_MMAP(v);
+        if (result) {
+            return result;
+        }
+        result = VOP_STAT(v, &st);
+        if (result) {
+            return result;
+        }
+    }
+    
+    result = EINVAL;
+    if ((vaddr & PAGE_FRAME) == vaddr && vaddr != 0) {
+        result = as_add_region(as, vaddr, npages,
+                               (prot & PROT_WRITE) != 0, &rg);
+    }
+    if (result == EINVAL && (flags & MAP_FIXED) == 0) {
+        vaddr = as_find_gap(as, VM_MMAPBASE, npages);
+        if (vaddr == 0) {
+            return ENOMEM;
+        }
+        result = as_add_region(as, vaddr, npages,
+                               (prot & PROT_WRITE) != 0, &rg);
+    }
+    if (result) {
+        return result;
+    }
+    
+    rg->rg_mapped = true;
+    rg->rg_shared = (flags & MAP_SHARED) != 0;
+    if (v != NULL) {
+        VOP_INCREF(v);
+        rg->rg_vnode = v;
+        rg->rg_filevaddr = vaddr;
+        rg->rg_fileoffset = offset;
+        
+        /* Whatever lies past the end of the file reads as zeros */
+        if (st.st_size > offset) {
+            rg->rg_filesize = npages * PAGE_SIZE;
+            if ((off_t)rg->rg_filesize > st.st_size - offset) {
+                rg->rg_filesize = st.st_size - offset;
+            }
+        }
+    }
+    
+    *ret = vaddr;
+    return 0;
+}
+
+int
+as_unmap(struct addrspace *as, vaddr_t vaddr, size_t len)
+{
+    struct region *rg;
+    unsigned i, num;
+    int result = 0;
+    
+    /* Only whole mappings can be removed */
+    rg = as_find_region(as, vaddr);
+    if (rg == NULL || !rg->rg_mapped || rg->rg_vbase != vaddr ||
+        rg->rg_npages != DIVROUNDUP(len, PAGE_SIZE)) {
+        return EINVAL;
+    }
+    
+    if (rg->rg_shared) {
+        result = as_sync_region(as, rg);
+    }
+    
+    as_drop_pages(as, rg->rg_vbase, rg->rg_npages);
+    
+    /* Close up the gap in the array */
+    i = as_region_upper(as, vaddr) - 1;
+    num = regionarray_num(as->as_regions);
+    KASSERT(regionarray_get(as->as_regions, i) == rg);
+    for (unsigned k = i; k + 1 < num; k++) {
+        regionarray_set(as->as_regions, k,
+                        regionarray_get(as->as_regions, k + 1));
+    }
+    regionarray_setsize(as->as_regions, num - 1);
+    region_destroy(rg);
+    
+    return result;
+}
+
+int
+as_sbrk(struct addrspace *as, intptr_t amount, vaddr_t *oldbreak)
+{
+    struct region *next;
+    vaddr_t newbreak = as->as_heapend + amount;
+    size_t npages, oldpages;
+    unsigned i;
+    int result;
+    
+    if (amount < 0) {
+        if (newbreak > as->as_heapend || newbreak < as->as_heapbase) {
+            return EINVAL;
+        }
+    }
+    else if (newbreak < as->as_heapend) {
+        /* Wrapped around the top of the address space */
+        return ENOMEM;
+    }
+    
+    npages = DIVROUNDUP(newbreak - as->as_heapbase, PAGE_SIZE);
+    if (as->as_heapbase + npages * PAGE_SIZE > USERSTACK - VM_STACKLIMIT) {
+        return ENOMEM;
+    }
+    oldpages = as->as_heap == NULL ? 0 : as->as_heap->rg_npages;
+    
+    if (as->as_heap == NULL && npages > 0) {
+        result = as_add_region(as, as->as_heapbase, npages, true,
+                               &as->as_heap);
+        if (result) {
+            /* Something else is already where the heap wants to go */
+            return result == EINVAL ? ENOMEM : result;
+        }
+    }
+    else if (npages > oldpages) {
+        /*
+         * A heap shrunk to nothing can share its base with a region
+         * mapped there since, which sorts after it, so check against
+         * whatever follows the heap's own slot.
+         */
+        i = as_region_upper(as, as->as_heapbase);
+        while (regionarray_get(as->as_regions, i - 1) != as->as_heap) {
+            i--;
+        }
+        if (i < regionarray_num(as->as_regions)) {
+            next = regionarray_get(as->as_regions, i);
+            if (as->as_heapbase + npages * PAGE_SIZE > next->rg_vbase) {
+                return ENOMEM;
+            }
+        }
+        as->as_heap->rg_npages = npages;
+    }
+    else if (npages < oldpages) {
+        as_drop_pages(as, as->as_heapbase + npages * PAGE_SIZE,
+                      oldpages - npages);
+        as->as_heap->rg_npages = npages;
+    }
+    
+    *oldbreak = as->as_heapend;
+    as->as_heapend = newbreak;
+    return 0;
+}
+
+int
+as_copy(struct addrspace *old, struct addrspace **ret)
+{
+    struct addrspace *new;
+    int result;
+    
+    new = as_create();
+    if (new==NULL) {
+        return ENOMEM;
+    }
+    
+    /* OLD's regions are already sorted, so they can just be appended */
+    for (unsigned i = 0; i < regionarray_num(old->as_regions); i++) {
+        struct region *oldrg = regionarray_get(old->as_regions, i);
+        struct region *newrg = kmalloc(sizeof(struct region));
+        if (newrg == NULL) {
+            as_destroy(new);
+            return ENOMEM;
+        }
+        *newrg = *oldrg;
+        if (newrg->rg_vnode != NULL) {
+            VOP_INCREF(newrg->rg_vnode);
+        }
+        result = regionarray_add(new->as_regions, newrg, NULL);
+        if (result) {
+            region_destroy(newrg);
+            as_destroy(new);
+            return result;
+        }
+        if (oldrg == old->as_stack) {
+            new->as_stack = newrg;
+        }
+        if (oldrg == old->as_heap) {
+            new->as_heap = newrg;
+        }
+    }
+    
+    new->as_heapbase = old->as_heapbase;
+    new->as_heapend = old->as_heapend;
+    
+    for (unsigned l1 = 0; l1 < PT_L1ENTRIES; l1++) {
+        if (old->as_pagetable[l1] == NULL) {
+            continue;
+        }
+        new->as_pagetable[l1] = pt_create_table();
+        if (new->as_pagetable[l1] == NULL) {
+            as_destroy(new);
+            return ENOMEM;
+        }
+        result = pt_copy_table(old, old->as_pagetable[l1], new->as_pagetable[l1]);
+        if (result) {
+            as_destroy(new);
+            return result;
+        }
+    }
+    
+    /*
+     * OLD belongs to the current process, so the only TLB that can still
+     * hold writable entries for the pages we just shared is this one.
+     * Its software TLB has them too.
+     */
+    spinlock_acquire(&old->as_lock);
+    as_stlb_flush(old);
+    spinlock_release(&old->as_lock);
+    vm_tlbshootdown_all();
+    
+    *ret = new;
+    return 0;
+}
@@ -7,16 +7,83 @@
 //
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include "coremap.h"
 #include "spinlock.h"
 #include "vm.h"
+#include <cpu.h>
+#include <thread.h>
+#include <current.h>
+#include <wchan.h>
+#include "opt-dumbvm.h"
+#if !OPT_DUMBVM
+#include <proc.h>
+#include <addrspace.h>
+#include "pagecache.h"
+#endif
+
+/*
+ * The coremap is managed as a binary buddy allocator. Every free block
+ * is a run of 2^order pages whose first index is a multiple of 2^order
+ * (relative to the first coremap page). Free blocks of each order are
+ * kept on a doubly linked list threaded through their own first page
+ * (struct coremap_freelink), so removing a buddy while coalescing is
+ * O(1).
+ *
+ * Allocations of npages are carved out of a block of the smallest order
+ * that fits, and the unused tail of that block is handed straight back,
+ * so a 3 page allocation costs 3 pages, not 4.
+ */
+
+// 2^20 pages is 4G, which is more than a 32-bit paddr_t can describe anyway
+#define CM_NORDERS 21
+#define CM_NONE (-1)
+
+/*
+ * Each frame has a 4 byte entry; its address follows from its index.
+ * CM_BUSY is set while the page is being evicted, CM_DIRTY means it
+ * differs from its copy on disk, and CM_REFERENCED is the clock's second
+ * chance bit. Entries only change under coremap_lock, or while nobody
+ * else can see the page.
+ */
+#define CM_USED       0x01  // Allocated, or in a per-cpu cache or the zero pool
+#define CM_BUSY       0x02
+#define CM_DIRTY      0x04
+#define CM_FREEHEAD   0x08  // First page of a free block
+#define CM_RUNHEAD    0x10  // First page of a run of more than one page
+#define CM_MOVING     0x20  // Busy being moved by cm_compact
+#define CM_REFERENCED 0x40
+#define CM_OWNED      0x80  // Mapped by one address space, named by count
+
+/*
+ * What count holds depends on the page:
+ *  - the first page of a free block: the block's order
+ *  - the first page of a multi-page run: the run's length
+ *  - a page on the zero pool or cm_compact's spare list: the next page,
+ *    as CM_LINK(index)
+ *  - a user page with CM_OWNED: its owner's slot in cmOwners. It has
+ *    only the one mapping; the pager evicts it through the owner and
+ *    finds the vaddr by walking the owner's page table
+ *  - any other user page: the number of address spaces mapping it
+ *  - a single kernel page: a tag for kmalloc (see cm_kpage_settag)
+ */
+#define CM_MAXCOUNT   0xffffff
+#define CM_LINK(index)   ((uint32_t)((index) + 1))  // 0 ends a list
+#define CM_UNLINK(count) ((int32_t)(count) - 1)
 
 struct coremap_entry {
-    paddr_t paddr;
-    paddr_t kvaddr;
-    uint32_t segmentLength;
-    bool isUsed;
+    uint32_t flags : 8;
+    uint32_t count : 24;
+};
+
+/*
+ * Free blocks are linked through the first few bytes of their own first
+ * page, since nobody else is using them.
+ */
+struct coremap_freelink {
+    int32_t next;
+    int32_t prev;
 };
 
 static struct coremap_entry *coremap;
@@ -25,18 +92,178 @@ static struct spinlock coremap_lock = SPINLOCK_INITIALIZER;
 static bool vm_initialized = false;
 static uint32_t first_coremap_page = -1;
 static uint32_t last_coremap_page = -1;
+static uint32_t numcoremap = 0;
+
+// Heads of the free lists, indexed by order
+static int32_t freeLists[CM_NORDERS];
+static uint32_t numFreePages = 0;
+
+// Where the clock left off, and where to wait for a busy page
+static uint32_t clockHand = 0;
+static struct wchan *busyWchan;
+
+/*
+ * Address spaces that can own pages, so an entry can name one in 24
+ * bits. as_create takes a slot with cm_owner_register, and as_destroy
+ * gives it back once every page is gone. Unused slots are chained
+ * through nextFree. The table doubles when it runs out. Each slot also
+ * counts the pages it owns, for the OOM killer.
+ */
+#define CM_OWNERS_MIN 16
+
+struct cm_owner {
+    struct addrspace *as;
+    int32_t nextFree;
+    uint32_t pages;
+};
+
+static struct cm_owner *cmOwners = NULL;
+static uint32_t cmOwnersMax = 0;
+static int32_t cmOwnersFree = CM_NONE;
+
+/*
+ * Pages zeroed ahead of time, kept on a stack threaded through their
+ * entries. They are marked used, so the buddy lists never see them until
+ * cm_zeropool_reclaim hands them back. Only idle cpus fill it, a few
+ * pages at a time from their idle loop, so the bzero happens while
+ * nobody is waiting for it.
+ */
+#define CM_ZEROPOOL_MAX 64
+#define CM_ZERO_BATCH 8     // Most pages zeroed per trip through the idle loop
+
+static int32_t zeroPool = CM_NONE;
+static uint32_t numZeroPages = 0;
+static uint32_t zeroPoolTarget = 0;
+static uint32_t zeroHits = 0;
+static uint32_t zeroMisses = 0;
+
+/*
+ * Single page allocations and frees normally go through a small stack of
+ * free pages hung off the current cpu (c_pagecache in struct cpu). When
+ * it runs dry it is refilled with CM_PAGECACHE_BATCH pages in one trip
+ * through coremap_lock, and when it fills up half of it is drained back
+ * the same way. Lock order is c_pagecache_lock, then coremap_lock.
+ */
+#define CM_PAGECACHE_BATCH (CPU_PAGECACHE_MAX / 2)
+
+static paddr_t cm_index_to_paddr(uint32_t index);
+
+static struct coremap_freelink *cm_freelink(uint32_t index)
+{
+    return (struct coremap_freelink *)PADDR_TO_KVADDR(cm_index_to_paddr(index));
+}
+
+static void cm_freelist_push(uint32_t index, unsigned order)
+{
+    KASSERT(spinlock_do_i_hold(&coremap_lock));
+    KASSERT(order < CM_NORDERS);
+
+    struct coremap_freelink *link = cm_freelink(index);
+    coremap[index].flags |= CM_FREEHEAD;
+    coremap[index].count = order;
+    link->prev = CM_NONE;
+    link->next = freeLists[order];
+    if (freeLists[order] != CM_NONE) {
+        cm_freelink(freeLists[order])->prev = index;
+    }
+    freeLists[order] = index;
+}
+
+static void cm_freelist_remove(uint32_t index)
+{
+    KASSERT(spinlock_do_i_hold(&coremap_lock));
+    KASSERT(coremap[index].flags & CM_FREEHEAD);
+
+    unsigned order = coremap[index].count;
+    struct coremap_freelink *link = cm_freelink(index);
+    if (link->prev != CM_NONE) {
+        cm_freelink(link->prev)->next = link->next;
+    } else {
+        KASSERT(freeLists[order] == (int32_t)index);
+        freeLists[order] = link->next;
+    }
+    if (link->next != CM_NONE) {
+        cm_freelink(link->next)->prev = link->prev;
+    }
+
+    coremap[index].flags &= ~CM_FREEHEAD;
+    coremap[index].count = 0;
+}
+
+/*
+ * Give the block of 2^order pages starting at index back to the free
+ * lists, merging it with its buddy for as long as the buddy is free too.
+ */
+static void cm_free_block(uint32_t index, unsigned order)
+{
+    KASSERT(spinlock_do_i_hold(&coremap_lock));
+    KASSERT((index & ((1 << order) - 1)) == 0);
+
+    while (order + 1 < CM_NORDERS) {
+        uint32_t buddy = index ^ (1 << order);
+        if (buddy + (1 << order) > numcoremap) {
+            break;
+        }
+        if (!(coremap[buddy].flags & CM_FREEHEAD) || coremap[buddy].count != order) {
+            break;
+        }
+        cm_freelist_remove(buddy);
+        if (buddy < index) {
+            index = buddy;
+        }
+        order++;
+    }
+
+    cm_freelist_push(index, order);
+}
+
+/*
+ * Return the pages [start, end) to the buddy lists by splitting the range
+ * into the largest naturally aligned blocks that fit.
+ */
+static void cm_free_range(uint32_t start, uint32_t end)
+{
+    KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+    while (start < end) {
+        unsigned order = 0;
+        while (order + 1 < CM_NORDERS &&
+               (start & ((1 << (order + 1)) - 1)) == 0 &&
+               start + (1 << (order + 1)) <= end) {
+            order++;
+        }
+        cm_free_block(start, order);
+        start += 1 << order;
+    }
+}
+
+static unsigned cm_order_for(unsigned long npages)
+{
+    unsigned order = 0;
+    while ((1UL << order) < npages) {
+        order++;
+    }
+    return order;
+}
 
 static void cm_initialize_coremap()
 {
     KASSERT(first_coremap_page > 0);
     KASSERT(last_coremap_page > 0);
     
-    for (uint32_t i = 0; i < (last_coremap_page - first_coremap_page); i++) {
-        coremap[i].isUsed = false;
-        coremap[i].paddr = first_coremap_page*PAGE_SIZE + i*PAGE_SIZE;
-        coremap[i].kvaddr = PADDR_TO_KVADDR(coremap[i].paddr);
-        coremap[i].segmentLength = 0;
+    for (uint32_t i = 0; i < numcoremap; i++) {
+        coremap[i].count = 0;
+        coremap[i].flags = 0;
+    }
+
+    for (unsigned k = 0; k < CM_NORDERS; k++) {
+        freeLists[k] = CM_NONE;
     }
+
+    spinlock_acquire(&coremap_lock);
+    cm_free_range(0, numcoremap);
+    numFreePages = numcoremap;
+    spinlock_release(&coremap_lock);
 }
 
 void cm_bootstrap(void)
@@ -70,57 +297,546 @@ void cm_bootstrap(void)
     // Make lo and high correspond to pages, and store them as the edges of the coremap
     first_coremap_page = lo / PAGE_SIZE;
     last_coremap_page = hi / PAGE_SIZE;
+    numcoremap = last_coremap_page - first_coremap_page;
+    KASSERT(numcoremap < CM_MAXCOUNT);
     
     cm_initialize_coremap();
     
     vm_initialized = true;
+
+    busyWchan = wchan_create("coremap busy");
+    if (busyWchan == NULL) {
+        panic("cm_bootstrap: Out of memory\n");
+    }
     return;
 }
 
+/*
+ * Allocate a run of npages from the buddy lists. Returns the coremap index
+ * of the first page, or CM_NONE if there isn't a free block big enough.
+ */
+static int32_t cm_alloc_run(unsigned long npages)
+{
+    KASSERT(spinlock_do_i_hold(&coremap_lock));
+    KASSERT(npages > 0);
+
+    // Find the smallest free block that can hold npages
+    unsigned order = cm_order_for(npages);
+    unsigned found = order;
+    while (found < CM_NORDERS && freeLists[found] == CM_NONE) {
+        found++;
+    }
+
+    if (found >= CM_NORDERS) {
+        DEBUG(DB_VM, "No free block of order %u, %u pages free\n", order, numFreePages);
+        return CM_NONE;
+    }
+
+    uint32_t start = freeLists[found];
+    cm_freelist_remove(start);
+
+    // Split the block down to the order we want, giving back the upper halves
+    while (found > order) {
+        found--;
+        cm_freelist_push(start + (1 << found), found);
+    }
+
+    // Give back the part of the block past npages
+    cm_free_range(start + npages, start + (1 << order));
+
+    DEBUG(DB_VM, "Found npages free starting at: %u\n", start);
+    // We are giving these pages back, so we should make them as used
+    for (uint32_t k = start; k < start + npages; k++) {
+        KASSERT(coremap[k].flags == 0);
+        coremap[k].flags = CM_USED;
+        coremap[k].count = 0;
+    }
+    if (npages > 1) {
+        coremap[start].flags |= CM_RUNHEAD;
+        coremap[start].count = npages;
+    }
+    numFreePages -= npages;
+
+    return start;
+}
+
+/*
+ * Give the run starting at coremapIndex back to the buddy lists.
+ */
+static void cm_free_run(uint32_t coremapIndex)
+{
+    KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+    KASSERT(coremap[coremapIndex].flags & CM_USED);
+    uint32_t segmentLength = 1;
+    if (coremap[coremapIndex].flags & CM_RUNHEAD) {
+        segmentLength = coremap[coremapIndex].count;
+    }
+    DEBUG(DB_VM, "Freeing segment at index: %u length: %u\n", coremapIndex, segmentLength);
+
+    for (uint32_t i = coremapIndex; i < coremapIndex + segmentLength; i++) {
+        coremap[i].flags = 0;
+        coremap[i].count = 0;
+    }
+
+    cm_free_range(coremapIndex, coremapIndex + segmentLength);
+    numFreePages += segmentLength;
+}
+
+static uint32_t cm_paddr_to_index(paddr_t paddr)
+{
+    KASSERT(paddr / PAGE_SIZE >= first_coremap_page);
+    KASSERT(paddr / PAGE_SIZE < last_coremap_page);
+    return paddr / PAGE_SIZE - first_coremap_page;
+}
+
+static paddr_t cm_index_to_paddr(uint32_t index)
+{
+    KASSERT(index < numcoremap);
+    return (paddr_t)(first_coremap_page + index) * PAGE_SIZE;
+}
+
+/*
+ * Whether the page is a single page mapped by at least one address
+ * space, as opposed to free, parked in a cache, held by the kernel, or
+ * part of a bigger run.
+ */
+static bool cm_is_mapped(uint32_t index)
+{
+    return (coremap[index].flags & (CM_USED | CM_RUNHEAD)) == CM_USED &&
+        ((coremap[index].flags & CM_OWNED) || coremap[index].count > 0);
+}
+
+// Address spaces mapping a page; an owned page has only its owner
+static uint32_t cm_refs(struct coremap_entry entry)
+{
+    return (entry.flags & CM_OWNED) ? 1 : entry.count;
+}
+
+// Stop being owned, keeping the one reference the owner had
+static void cm_disown(uint32_t index)
+{
+    KASSERT(spinlock_do_i_hold(&coremap_lock));
+    KASSERT(coremap[index].flags & CM_OWNED);
+
+    cmOwners[coremap[index].count].pages--;
+    coremap[index].flags &= ~CM_OWNED;
+    coremap[index].count = 1;
+}
+
+/*
+ * Take a page from this cpu's page cache, refilling it from the coremap
+ * if it's empty. Returns 0 if there are no free pages left anywhere we
+ * can get at cheaply.
+ */
+static paddr_t cm_pagecache_get(void)
+{
+    struct cpu *c = curcpu->c_self;
+    paddr_t paddr;
+
+    spinlock_acquire(&c->c_pagecache_lock);
+    if (c->c_pagecache_count == 0) {
+        c->c_pagecache_misses++;
+        spinlock_acquire(&coremap_lock);
+        while (c->c_pagecache_count < CM_PAGECACHE_BATCH) {
+            int32_t index = cm_alloc_run(1);
+            if (index == CM_NONE) {
+                break;
+            }
+            c->c_pagecache[c->c_pagecache_count++] = cm_index_to_paddr(index);
+        }
+        spinlock_release(&coremap_lock);
+
+        if (c->c_pagecache_count == 0) {
+            spinlock_release(&c->c_pagecache_lock);
+            return 0;
+        }
+    } else {
+        c->c_pagecache_hits++;
+    }
+
+    paddr = c->c_pagecache[--c->c_pagecache_count];
+    spinlock_release(&c->c_pagecache_lock);
+    return paddr;
+}
+
+/*
+ * Put a single page on this cpu's page cache, draining half of the cache
+ * back to the coremap first if it's full.
+ */
+static void cm_pagecache_put(paddr_t paddr)
+{
+    struct cpu *c = curcpu->c_self;
+
+    spinlock_acquire(&c->c_pagecache_lock);
+    if (c->c_pagecache_count == CPU_PAGECACHE_MAX) {
+        c->c_pagecache_drains++;
+        spinlock_acquire(&coremap_lock);
+        while (c->c_pagecache_count > CPU_PAGECACHE_MAX - CM_PAGECACHE_BATCH) {
+            paddr_t drained = c->c_pagecache[--c->c_pagecache_count];
+            cm_free_run(cm_paddr_to_index(drained));
+        }
+        spinlock_release(&coremap_lock);
+    } else {
+        c->c_pagecache_frees++;
+    }
+
+    c->c_pagecache[c->c_pagecache_count++] = paddr;
+    spinlock_release(&c->c_pagecache_lock);
+}
+
+/*
+ * Empty every cpu's page cache back into the coremap, so that pages
+ * parked on other cpus can be used (or coalesced) when memory is short.
+ */
+static void cm_pagecache_reclaim(void)
+{
+    for (unsigned i = 0; i < cpu_count(); i++) {
+        struct cpu *c = cpu_get(i);
+
+        spinlock_acquire(&c->c_pagecache_lock);
+        spinlock_acquire(&coremap_lock);
+        while (c->c_pagecache_count > 0) {
+            paddr_t drained = c->c_pagecache[--c->c_pagecache_count];
+            cm_free_run(cm_paddr_to_index(drained));
+        }
+        spinlock_release(&coremap_lock);
+        spinlock_release(&c->c_pagecache_lock);
+    }
+}
+
+/*
+ * Give every pre-zeroed page back to the buddy lists.
+ */
+static void cm_zeropool_reclaim(void)
+{
+    spinlock_acquire(&coremap_lock);
+    while (zeroPool != CM_NONE) {
+        int32_t index = zeroPool;
+        zeroPool = CM_UNLINK(coremap[index].count);
+        numZeroPages--;
+        cm_free_run(index);
+    }
+    spinlock_release(&coremap_lock);
+}
+
+/*
+ * Reset the page state for a run that was just handed out.
+ */
+static void cm_claim(uint32_t coremapIndex)
+{
+    // The caller has the page to itself, so nobody else changes its entry
+    KASSERT((coremap[coremapIndex].flags & (CM_BUSY | CM_OWNED)) == 0);
+    coremap[coremapIndex].flags &= ~(CM_DIRTY | CM_REFERENCED);
+    if ((coremap[coremapIndex].flags & CM_RUNHEAD) == 0) {
+        coremap[coremapIndex].count = 1;
+    }
+}
+
+#if !OPT_DUMBVM
+/*
+ * Run the clock over the coremap looking for a user page to evict. Pages
+ * that were referenced since the hand last passed get a second chance.
+ * Only owned pages are taken, since we don't know where shared ones are
+ * mapped. The victim is marked busy so nobody else can take or share it.
+ */
+static int32_t cm_clock_victim(void)
+{
+    KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+    // Two trips around clears every referenced bit on the way
+    for (uint32_t n = 0; n < 2 * numcoremap; n++) {
+        uint32_t index = clockHand;
+        clockHand = (clockHand + 1) % numcoremap;
+
+        struct coremap_entry *entry = &coremap[index];
+        if (!cm_is_mapped(index) || (entry->flags & CM_OWNED) == 0 ||
+            (entry->flags & CM_BUSY)) {
+            continue;
+        }
+        if (entry->flags & CM_REFERENCED) {
+            entry->flags &= ~CM_REFERENCED;
+            continue;
+        }
+
+        entry->flags |= CM_BUSY;
+        return index;
+    }
+
+    return CM_NONE;
+}
+
+/*
+ * Push one user page out of memory and give its frame back to the free
+ * lists. Returns false if there was nothing that could be evicted.
+ */
+static bool cm_evict_one(void)
+{
+    // Eviction sleeps on disk I/O
+    if (curthread->t_in_interrupt || curthread->t_curspl > 0) {
+        return false;
+    }
+
+    spinlock_acquire(&coremap_lock);
+    int32_t victim = cm_clock_victim();
+    if (victim == CM_NONE) {
+        spinlock_release(&coremap_lock);
+        return false;
+    }
+    struct addrspace *owner = cmOwners[coremap[victim].count].as;
+    paddr_t paddr = cm_index_to_paddr(victim);
+    spinlock_release(&coremap_lock);
+
+    DEBUG(DB_VM, "Evicting PADDR: 0x%x\n", paddr);
+    int result = vm_evictpage(owner, paddr);
+
+    spinlock_acquire(&coremap_lock);
+    coremap[victim].flags &= ~CM_BUSY;
+    if (result == 0) {
+        cmOwners[coremap[victim].count].pages--;
+        coremap[victim].flags &= ~CM_OWNED;
+        coremap[victim].count = 0;
+        cm_free_run(victim);
+    }
+    spinlock_release(&coremap_lock);
+
+    wchan_wakeall(busyWchan);
+    return result == 0;
+}
+
+/*
+ * Compaction: when there are enough free pages for a multi-page run but
+ * they're scattered, pick the aligned block of the right size that needs
+ * the fewest user pages moved out of it, and move them to frames outside
+ * it. Kernel and shared pages can't be moved, so blocks holding any are
+ * skipped. Returns the number of pages moved.
+ */
+static uint32_t compactPasses = 0;
+static uint32_t compactMoved = 0;
+
+static bool cm_is_movable(uint32_t index)
+{
+    return cm_is_mapped(index) && (coremap[index].flags & CM_OWNED) &&
+        (coremap[index].flags & CM_BUSY) == 0;
+}
+
+static int32_t cm_compact_window(uint32_t size, uint32_t *moves)
+{
+    int32_t best = CM_NONE;
+    uint32_t bestMoves = 0;
+
+    KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+    for (uint32_t w = 0; w + size <= numcoremap; w += size) {
+        uint32_t count = 0;
+        bool movable = true;
+        for (uint32_t k = w; k < w + size && movable; k++) {
+            if (coremap[k].flags & CM_USED) {
+                movable = cm_is_movable(k);
+                count++;
+            }
+        }
+        if (movable && count > 0 && (best == CM_NONE || count < bestMoves)) {
+            best = w;
+            bestMoves = count;
+        }
+    }
+
+    *moves = bestMoves;
+    return best;
+}
+
+static uint32_t cm_compact(unsigned long npages)
+{
+    uint32_t size = 1 << cm_order_for(npages);
+    uint32_t moves, moved = 0;
+    int32_t spare = CM_NONE;
+
+    // Moving pages shoots down TLBs, which sleeps
+    if (curthread->t_in_interrupt || curthread->t_curspl > 0 || size > numcoremap) {
+        return 0;
+    }
+
+    spinlock_acquire(&coremap_lock);
+    int32_t window = cm_compact_window(size, &moves);
+    // The pages in the window that are free now can't take anything
+    if (window == CM_NONE || numFreePages - (size - moves) < moves) {
+        spinlock_release(&coremap_lock);
+        return 0;
+    }
+    uint32_t end = window + size;
+
+    // Nobody can map, share or evict them while they're busy
+    for (uint32_t k = window; k < end; k++) {
+        if (coremap[k].flags & CM_USED) {
+            coremap[k].flags |= CM_BUSY | CM_MOVING;
+        }
+    }
+    spinlock_release(&coremap_lock);
+
+    for (uint32_t k = window; k < end; k++) {
+        if ((coremap[k].flags & CM_MOVING) == 0) {
+            continue;
+        }
+
+        // Find a frame outside the window; ones inside are kept aside
+        spinlock_acquire(&coremap_lock);
+        int32_t dest = cm_alloc_run(1);
+        while (dest != CM_NONE && (uint32_t)dest >= (uint32_t)window && (uint32_t)dest < end) {
+            coremap[dest].count = CM_LINK(spare);
+            spare = dest;
+            dest = cm_alloc_run(1);
+        }
+        if (dest == CM_NONE) {
+            // Somebody took the free pages; put the rest back as they were
+            for (uint32_t j = k; j < end; j++) {
+                if (coremap[j].flags & CM_MOVING) {
+                    coremap[j].flags &= ~(CM_BUSY | CM_MOVING);
+                }
+            }
+            spinlock_release(&coremap_lock);
+            break;
+        }
+
+        // Busy until its page table entry points at it
+        struct addrspace *owner = cmOwners[coremap[k].count].as;
+        coremap[dest].count = coremap[k].count;
+        coremap[dest].flags |= CM_BUSY | CM_OWNED |
+            (coremap[k].flags & (CM_DIRTY | CM_REFERENCED));
+        spinlock_release(&coremap_lock);
+
+        vm_movepage(owner, cm_index_to_paddr(k), cm_index_to_paddr(dest));
+
+        spinlock_acquire(&coremap_lock);
+        coremap[dest].flags &= ~CM_BUSY;
+        coremap[k].flags &= ~(CM_BUSY | CM_MOVING | CM_OWNED);
+        coremap[k].count = 0;
+        cm_free_run(k);
+        spinlock_release(&coremap_lock);
+        wchan_wakeall(busyWchan);
+        moved++;
+    }
+
+    spinlock_acquire(&coremap_lock);
+    while (spare != CM_NONE) {
+        int32_t index = spare;
+        spare = CM_UNLINK(coremap[index].count);
+        cm_free_run(index);
+    }
+    compactPasses++;
+    compactMoved += moved;
+    spinlock_release(&coremap_lock);
+    wchan_wakeall(busyWchan);
+
+    DEBUG(DB_VM, "Compaction for %lu pages moved %u pages\n", npages, moved);
+    return moved;
+}
+
+/*
+ * Out of memory, even after evicting everything we could. If we're
+ * allowed to sleep and aren't the one dying, have the biggest process
+ * killed and give it a few chances to exit and free its pages. Callers
+ * that can't wait just fail, without killing anybody for memory they
+ * wouldn't get.
+ */
+#define CM_OOM_YIELDS 16
+
+static int32_t cm_oom(unsigned long npages)
+{
+    int32_t start = CM_NONE;
+
+    if (curthread->t_in_interrupt || curthread->t_curspl > 0 ||
+        curproc == NULL || curproc->p_killed) {
+        return CM_NONE;
+    }
+    if (!proc_oom_kill()) {
+        return CM_NONE;
+    }
+
+    for (unsigned i = 0; i < CM_OOM_YIELDS && start == CM_NONE; i++) {
+        thread_yield();
+        cm_pagecache_reclaim();
+        cm_zeropool_reclaim();
+        spinlock_acquire(&coremap_lock);
+        start = cm_alloc_run(npages);
+        spinlock_release(&coremap_lock);
+    }
+    return start;
+}
+#endif
+
 paddr_t cm_getppages(unsigned long npages)
 {
     paddr_t addr;
     
     if (vm_initialized) {
-        // Need to find npages free pages in the coremap. Search from the front for a block of the right length
-        spinlock_acquire(&coremap_lock);
+        KASSERT(npages > 0);
         DEBUG(DB_VM, "Asked for npages: %lu\n", npages);
-        bool startSet = false;
-        uint32_t start = 0;
-        uint32_t found = 0;
-        uint32_t numcoremap = last_coremap_page - first_coremap_page;
-        for (uint32_t i = 0; i < numcoremap; i++) {
-            if (coremap[i].isUsed == true) {
-                start = 0;
-                found = 0;
-                startSet = false;
-            } else {
-                if (startSet == false) {
-                    start = i;
-                    startSet = true;
-                }
-                found++;
                 
-                // We found a block that is long enough to give, so return the starting paddr
-                if (found == npages) {
-                    DEBUG(DB_VM, "Found npages free starting at: %u\n", start);
-                    // We are giving these pages back, so we should make them as used
-                    for (uint32_t k = start; k < start + npages; k++) {
-                        coremap[k].isUsed = true;
-                        coremap[k].segmentLength = npages - (k - start);
-                    }
-                    DEBUG(DB_VM, "Returning paddr for npages: 0x%x\n", coremap[start].paddr);
-                    spinlock_release(&coremap_lock);
-                    return coremap[start].paddr;
-                }
+        if (npages == 1) {
+            addr = cm_pagecache_get();
+            if (addr != 0) {
+                cm_claim(cm_paddr_to_index(addr));
+                return addr;
             }
         }
         
-        for (uint32_t i = 0; i < numcoremap; i++) {
-            DEBUG(DB_VM, "Page State: %u: %u\n", i, coremap[i].isUsed);
-        }
+        spinlock_acquire(&coremap_lock);
+        int32_t start = cm_alloc_run(npages);
         spinlock_release(&coremap_lock);
-        panic("There aren't any free pages\n");
+
+        if (start == CM_NONE) {
+            // There may be enough pages sitting in the per-cpu caches
+            // or the zero pool, or empty in the kernel heap
+            kheap_reclaim();
+            cm_pagecache_reclaim();
+            cm_zeropool_reclaim();
+            spinlock_acquire(&coremap_lock);
+            start = cm_alloc_run(npages);
+            spinlock_release(&coremap_lock);
+        }
+
+#if !OPT_DUMBVM
+        // Executables nobody is running any more are cheaper than swap
+        if (start == CM_NONE && pagecache_reclaim() > 0) {
+            cm_pagecache_reclaim();
+            spinlock_acquire(&coremap_lock);
+            start = cm_alloc_run(npages);
+            spinlock_release(&coremap_lock);
+        }
+
+        // Make room by pushing user pages out to swap. A run of several
+        // pages may only need the free pages we have moved together.
+        while (start == CM_NONE) {
+            if (npages > 1 && numFreePages >= npages && cm_compact(npages) > 0) {
+                spinlock_acquire(&coremap_lock);
+                start = cm_alloc_run(npages);
+                spinlock_release(&coremap_lock);
+                if (start != CM_NONE) {
+                    break;
+                }
+            }
+            if (!cm_evict_one()) {
+                break;
+            }
+            spinlock_acquire(&coremap_lock);
+            start = cm_alloc_run(npages);
+            spinlock_release(&coremap_lock);
+        }
+
+        if (start == CM_NONE) {
+            start = cm_oom(npages);
+        }
+#endif
+
+        if (start == CM_NONE) {
+            DEBUG(DB_VM, "No run of %lu free pages\n", npages);
+            return 0;
+        }
+
+        cm_claim(start);
+        DEBUG(DB_VM, "Returning paddr for npages: 0x%x\n", cm_index_to_paddr(start));
+        return cm_index_to_paddr(start);
     } else {
         spinlock_acquire(&stealmem_lock);
         addr = ram_stealmem(npages);
@@ -138,27 +854,390 @@ vaddr_t cm_alloc_kpages(int npages)
         return 0;
     }
     
+    // Nothing maps a kernel page, so a single one's count is free for its tag
+    if (vm_initialized && npages == 1) {
+        coremap[cm_paddr_to_index(pa)].count = 0;
+    }
     return PADDR_TO_KVADDR(pa);
 }
 
 void cm_free_kpages(vaddr_t addr)
 {
     if (vm_initialized) {
-        spinlock_acquire(&coremap_lock);
         paddr_t paddr = addr - MIPS_KSEG0;
         DEBUG(DB_VM, "Asked to free VADDR: 0x%x, PADDR: 0x%x\n", addr, paddr);
         
-        uint32_t coremapIndex = paddr / PAGE_SIZE - first_coremap_page;
-        
-        uint32_t segmentLength = coremap[coremapIndex].segmentLength;
-        DEBUG(DB_VM, "Freeing segment at index: %u length: %u\n", coremapIndex, segmentLength);
-        
-        for (uint32_t i = coremapIndex; i < coremapIndex + segmentLength; i++) {
-            DEBUG(DB_VM, "Freeing segment at index: %u\n", i);
-            coremap[i].segmentLength = 0;
-            coremap[i].isUsed = false;
+        // Memory stolen before the coremap existed can't be given back
+        if (paddr / PAGE_SIZE < first_coremap_page || paddr / PAGE_SIZE >= last_coremap_page) {
+            DEBUG(DB_VM, "Not freeing unmanaged PADDR: 0x%x\n", paddr);
+            return;
         }
         
+        uint32_t coremapIndex = cm_paddr_to_index(paddr);
+        KASSERT(coremap[coremapIndex].flags & CM_USED);
+
+        // The caller owns this run, so its length can't change under us
+        if ((coremap[coremapIndex].flags & CM_RUNHEAD) == 0) {
+            cm_pagecache_put(paddr);
+            return;
+        }
+
+        spinlock_acquire(&coremap_lock);
+        cm_free_run(coremapIndex);
+        spinlock_release(&coremap_lock);
+    }
+}
+
+/*
+ * Find the coremap entry of a single page the kernel holds, or return
+ * CM_NONE for pages we don't manage or that are part of a bigger run.
+ * The caller owns the page, so its flags won't change under us.
+ */
+static int32_t cm_kpage_index(vaddr_t addr)
+{
+    paddr_t paddr = addr - MIPS_KSEG0;
+
+    if (!vm_initialized || paddr / PAGE_SIZE < first_coremap_page ||
+        paddr / PAGE_SIZE >= last_coremap_page) {
+        return CM_NONE;
+    }
+
+    uint32_t coremapIndex = cm_paddr_to_index(paddr);
+    if ((coremap[coremapIndex].flags & (CM_USED | CM_RUNHEAD)) != CM_USED) {
+        return CM_NONE;
+    }
+    KASSERT((coremap[coremapIndex].flags & CM_OWNED) == 0);
+    return coremapIndex;
+}
+
+void cm_kpage_settag(vaddr_t addr, uint32_t tag)
+{
+    int32_t coremapIndex = cm_kpage_index(addr & PAGE_FRAME);
+    KASSERT(tag <= CM_MAXCOUNT);
+    if (coremapIndex != CM_NONE) {
+        coremap[coremapIndex].count = tag;
+    }
+}
+
+uint32_t cm_kpage_tag(vaddr_t addr)
+{
+    int32_t coremapIndex = cm_kpage_index(addr & PAGE_FRAME);
+    if (coremapIndex == CM_NONE) {
+        return 0;
+    }
+    return coremap[coremapIndex].count;
+}
+
+/*
+ * Get a single page that is already filled with zeros, preferably one
+ * an idle cpu prepared earlier.
+ */
+paddr_t cm_getzeroedpage(void)
+{
+    int32_t index = CM_NONE;
+
+    spinlock_acquire(&coremap_lock);
+    if (zeroPool != CM_NONE) {
+        index = zeroPool;
+        zeroPool = CM_UNLINK(coremap[index].count);
+        numZeroPages--;
+        zeroHits++;
+    } else {
+        zeroMisses++;
+    }
+    spinlock_release(&coremap_lock);
+
+    if (index != CM_NONE) {
+        cm_claim(index);
+        return cm_index_to_paddr(index);
+    }
+
+    paddr_t paddr = cm_getppages(1);
+    if (paddr != 0) {
+        bzero((void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE);
+    }
+    return paddr;
+}
+
+/*
+ * Whether the zero pool could use another page. Leave the last pages
+ * for real allocations rather than zeroing them. Racy, but only used
+ * as a hint.
+ */
+static bool cm_zero_wanted(void)
+{
+    return numZeroPages < zeroPoolTarget && numFreePages > zeroPoolTarget;
+}
+
+/*
+ * Size the zero pool. It is kept to a small share of memory so it never
+ * competes with real allocations, and stays empty until this is called.
+ */
+void cm_zero_bootstrap(void)
+{
+    zeroPoolTarget = numcoremap / 16;
+    if (zeroPoolTarget > CM_ZEROPOOL_MAX) {
+        zeroPoolTarget = CM_ZEROPOOL_MAX;
+    }
+}
+
+/*
+ * Called by a cpu with nothing to run, with interrupts off. Zero up to
+ * CM_ZERO_BATCH pages for the pool, stopping as soon as somebody puts a
+ * thread on our run queue. Returns true if that happened, so the cpu
+ * goes straight back to it; otherwise it sleeps until the next
+ * interrupt, which also lets pending interrupts in between batches.
+ */
+bool cm_idle(void)
+{
+    for (unsigned i = 0; i < CM_ZERO_BATCH && cm_zero_wanted(); i++) {
+        // Racy, but a thread that just missed it only waits one page
+        if (!threadlist_isempty(&curcpu->c_runqueue)) {
+            return true;
+        }
+
+        spinlock_acquire(&coremap_lock);
+        int32_t index = cm_alloc_run(1);
+        spinlock_release(&coremap_lock);
+        if (index == CM_NONE) {
+            break;
+        }
+
+        // Nobody else can see this page, so zero it without any locks
+        bzero((void *)PADDR_TO_KVADDR(cm_index_to_paddr(index)), PAGE_SIZE);
+
+        spinlock_acquire(&coremap_lock);
+        coremap[index].count = CM_LINK(zeroPool);
+        zeroPool = index;
+        numZeroPages++;
+        spinlock_release(&coremap_lock);
+    }
+    return !threadlist_isempty(&curcpu->c_runqueue);
+}
+
+/*
+ * Reference counts for user pages shared copy-on-write between address
+ * spaces. A page comes back from cm_getppages with a count of 1. A busy
+ * page can't gain or lose references; the caller has to wait for the
+ * eviction to finish and look at its page table again.
+ */
+bool cm_page_incref(paddr_t paddr)
+{
+    uint32_t coremapIndex = cm_paddr_to_index(paddr);
+
+    spinlock_acquire(&coremap_lock);
+    KASSERT(cm_is_mapped(coremapIndex));
+    if (coremap[coremapIndex].flags & CM_BUSY) {
+        spinlock_release(&coremap_lock);
+        return false;
+    }
+    if (coremap[coremapIndex].flags & CM_OWNED) {
+        // Shared now, so nobody owns it
+        cm_disown(coremapIndex);
+    }
+    KASSERT(coremap[coremapIndex].count < CM_MAXCOUNT);
+    coremap[coremapIndex].count++;
+    spinlock_release(&coremap_lock);
+    return true;
+}
+
+bool cm_page_decref(paddr_t paddr, struct addrspace *as)
+{
+    uint32_t coremapIndex = cm_paddr_to_index(paddr);
+    uint32_t refCount;
+
+    spinlock_acquire(&coremap_lock);
+    KASSERT(cm_is_mapped(coremapIndex));
+    if (coremap[coremapIndex].flags & CM_BUSY) {
+        spinlock_release(&coremap_lock);
+        return false;
+    }
+    if (coremap[coremapIndex].flags & CM_OWNED) {
+        KASSERT(cmOwners[coremap[coremapIndex].count].as == as);
+        cm_disown(coremapIndex);
+    }
+    refCount = --coremap[coremapIndex].count;
+    spinlock_release(&coremap_lock);
+
+    // The last mapping is gone, so nobody else can be looking at the page
+    if (refCount == 0) {
+        cm_free_kpages(PADDR_TO_KVADDR(paddr));
+    }
+    return true;
+}
+
+/*
+ * Only the address spaces holding a page can add references to it, so a
+ * caller that sees a count of 1 can trust it without the lock.
+ */
+uint32_t cm_page_refcount(paddr_t paddr)
+{
+    return cm_refs(coremap[cm_paddr_to_index(paddr)]);
+}
+
+/*
+ * Give as a slot in cmOwners, growing the table if there are none free.
+ */
+int cm_owner_register(struct addrspace *as, uint32_t *slot)
+{
+    struct cm_owner *grown = NULL, *old = NULL;
+    uint32_t grownMax = 0;
+
+    while (true) {
+        spinlock_acquire(&coremap_lock);
+        if (grown != NULL && grownMax > cmOwnersMax) {
+            // Nobody beat us to it; chain the new slots onto the free list
+            for (uint32_t i = 0; i < cmOwnersMax; i++) {
+                grown[i] = cmOwners[i];
+            }
+            for (uint32_t i = cmOwnersMax; i < grownMax; i++) {
+                grown[i].as = NULL;
+                grown[i].pages = 0;
+                grown[i].nextFree = i + 1 < grownMax ? (int32_t)(i + 1) : cmOwnersFree;
+            }
+            cmOwnersFree = cmOwnersMax;
+            old = cmOwners;
+            cmOwners = grown;
+            cmOwnersMax = grownMax;
+            grown = NULL;
+        }
+
+        if (cmOwnersFree != CM_NONE) {
+            *slot = cmOwnersFree;
+            cmOwnersFree = cmOwners[*slot].nextFree;
+            cmOwners[*slot].as = as;
+            spinlock_release(&coremap_lock);
+            kfree(old);
+            kfree(grown);
+            return 0;
+        }
+        grownMax = cmOwnersMax == 0 ? CM_OWNERS_MIN : 2 * cmOwnersMax;
         spinlock_release(&coremap_lock);
+
+        // kmalloc can come back into the coremap, so not under the lock
+        kfree(old);
+        kfree(grown);
+        old = NULL;
+        KASSERT(grownMax <= CM_MAXCOUNT);
+        grown = kmalloc(grownMax * sizeof(struct cm_owner));
+        if (grown == NULL) {
+            return ENOMEM;
+        }
+    }
+}
+
+// Every page as owned must be gone by now
+void cm_owner_unregister(uint32_t slot)
+{
+    spinlock_acquire(&coremap_lock);
+    KASSERT(slot < cmOwnersMax && cmOwners[slot].as != NULL);
+    KASSERT(cmOwners[slot].pages == 0);
+    cmOwners[slot].as = NULL;
+    cmOwners[slot].nextFree = cmOwnersFree;
+    cmOwnersFree = slot;
+    spinlock_release(&coremap_lock);
+}
+
+#if !OPT_DUMBVM
+/*
+ * Note that as touched the page, giving it a second chance from the
+ * clock. If as is the only one mapping it, it becomes the owner. Both
+ * only change once per trip of the clock hand, so the lock is only
+ * taken then.
+ */
+void cm_page_touch(paddr_t paddr, struct addrspace *as)
+{
+    uint32_t index = cm_paddr_to_index(paddr);
+    struct coremap_entry entry = coremap[index];
+
+    if ((entry.flags & CM_REFERENCED) &&
+        ((entry.flags & CM_OWNED) || entry.count != 1)) {
+        return;
+    }
+
+    spinlock_acquire(&coremap_lock);
+    coremap[index].flags |= CM_REFERENCED;
+    if ((coremap[index].flags & CM_OWNED) == 0 && coremap[index].count == 1) {
+        coremap[index].flags |= CM_OWNED;
+        coremap[index].count = as->as_cmowner;
+        cmOwners[as->as_cmowner].pages++;
+    }
+    spinlock_release(&coremap_lock);
+}
+
+/*
+ * Kept up to date as pages change hands, so the OOM killer can size up
+ * every process without scanning the coremap. The caller keeps as alive.
+ */
+uint32_t cm_resident_pages(struct addrspace *as)
+{
+    spinlock_acquire(&coremap_lock);
+    uint32_t pages = cmOwners[as->as_cmowner].pages;
+    spinlock_release(&coremap_lock);
+    return pages;
+}
+#endif
+
+/*
+ * The dirty bit is only set by the owner while its TLB entry is being
+ * upgraded, and only read by the pager once every TLB entry for the page
+ * is gone, so reading it doesn't need the lock. Setting it does, since
+ * it shares a word with everything else.
+ */
+void cm_page_setdirty(paddr_t paddr)
+{
+    uint32_t index = cm_paddr_to_index(paddr);
+
+    spinlock_acquire(&coremap_lock);
+    coremap[index].flags |= CM_DIRTY;
+    spinlock_release(&coremap_lock);
+}
+
+bool cm_page_isdirty(paddr_t paddr)
+{
+    return (coremap[cm_paddr_to_index(paddr)].flags & CM_DIRTY) != 0;
+}
+
+bool cm_page_isbusy(paddr_t paddr)
+{
+    return (coremap[cm_paddr_to_index(paddr)].flags & CM_BUSY) != 0;
+}
+
+// Sleep until the page is no longer being evicted
+void cm_page_waitbusy(paddr_t paddr)
+{
+    struct coremap_entry *entry = &coremap[cm_paddr_to_index(paddr)];
+
+    wchan_lock(busyWchan);
+    while (entry->flags & CM_BUSY) {
+        wchan_sleep(busyWchan);
+        wchan_lock(busyWchan);
+    }
+    wchan_unlock(busyWchan);
+}
+
+void cm_printstats(void)
+{
+    unsigned cached = 0;
+
+    kprintf("Coremap: %u pages, %u free in buddy lists\n", numcoremap, numFreePages);
+    for (unsigned i = 0; i < cpu_count(); i++) {
+        struct cpu *c = cpu_get(i);
+        unsigned allocs = c->c_pagecache_hits + c->c_pagecache_misses;
+        unsigned frees = c->c_pagecache_frees + c->c_pagecache_drains;
+
+        kprintf("cpu%u page cache: %u cached, alloc hits %u/%u (%u%%), free hits %u/%u (%u%%)\n",
+                c->c_number, c->c_pagecache_count,
+                c->c_pagecache_hits, allocs,
+                allocs == 0 ? 0 : c->c_pagecache_hits * 100 / allocs,
+                c->c_pagecache_frees, frees,
+                frees == 0 ? 0 : c->c_pagecache_frees * 100 / frees);
+        cached += c->c_pagecache_count;
     }
+    kprintf("Coremap: %u pages free in total\n", numFreePages + cached);
+    kprintf("Zero pool: %u/%u pages, hits %u/%u\n", numZeroPages, zeroPoolTarget,
+            zeroHits, zeroHits + zeroMisses);
+#if !OPT_DUMBVM
+    kprintf("Compaction: %u passes, %u pages moved\n", compactPasses, compactMoved);
+#endif
 }
@@ -30,7 +30,13 @@
 #include <types.h>
 #include <lib.h>
 #include <spinlock.h>
+#include <spl.h>
+#include <cpu.h>
+#include <current.h>
 #include <vm.h>
+#include <coremap.h>
+#include <kmem_cache.h>
+#include <kmprofile.h>
 
 /*
  * Kernel malloc.
@@ -186,13 +192,30 @@ freepageref(struct pageref *p)
 static struct pageref *sizebases[NSIZES];
 static struct pageref *allbase;
 
+/*
+ * Pages with every block free are kept for reuse rather than handed
+ * straight back, so a size class that keeps filling and emptying one
+ * page doesn't go back and forth to the coremap each time. Once a
+ * size class has more than EMPTY_PAGES_HIGH of them, all but
+ * EMPTY_PAGES_LOW go back. kheap_reclaim gives back the rest when
+ * memory runs short.
+ *
+ * Pages from before the coremap existed would just be lost if we gave
+ * them back, so they stay for good. Empty ones are counted apart in
+ * nkeptpages, so they never push a size class over EMPTY_PAGES_HIGH.
+ */
+#define EMPTY_PAGES_HIGH 2
+#define EMPTY_PAGES_LOW  1
+
+static unsigned nemptypages[NSIZES];
+static unsigned nkeptpages[NSIZES];
+static unsigned pages_returned;
+
 ////////////////////////////////////////
 
 /*
- * Use one spinlock for the whole thing. Making parts of the kmalloc
- * logic per-cpu is worthwhile for scalability; however, for the time
- * being at least we won't, because it adds a lot of complexity and in
- * OS/161 performance and scalability aren't super-critical.
+ * Use one spinlock for the pages. Most allocations never take it,
+ * because the per-cpu magazines (further down) sit in front.
  */
 
 static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
@@ -330,10 +353,13 @@ dumpsubpage(struct pageref *pr)
 	kprintf("\n");
 }
 
+static void magazine_printstats(void);
+
 void
 kheap_printstats(void)
 {
 	struct pageref *pr;
+	unsigned i;
 
 	/* print the whole thing with interrupts off */
 	spinlock_acquire(&kmalloc_spinlock);
@@ -344,7 +370,16 @@ kheap_printstats(void)
 		dumpsubpage(pr);
 	}
 
+	kprintf("Empty pages kept:");
+	for (i=0; i<NSIZES; i++) {
+		kprintf(" %u", nemptypages[i] + nkeptpages[i]);
+	}
+	kprintf("\nPages returned to the coremap: %u\n", pages_returned);
+
 	spinlock_release(&kmalloc_spinlock);
+
+	/* Blocks sitting in magazines show up above as allocated */
+	magazine_printstats();
 }
 
 ////////////////////////////////////////
@@ -392,6 +427,77 @@ int blocktype(size_t sz)
 	return 0;
 }
 
+/*
+ * Count PR, which has just become empty or is about to stop being empty,
+ * as DELTA empty pages of size class BLKTYPE.
+ */
+static
+void
+subpage_countempty(struct pageref *pr, unsigned blktype, int delta)
+{
+	unsigned *count;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	if (cm_kpage_tag(PR_PAGEADDR(pr)) == 0) {
+		count = &nkeptpages[blktype];
+	}
+	else {
+		count = &nemptypages[blktype];
+	}
+	KASSERT(delta > 0 || *count > 0);
+	*count += delta;
+}
+
+/*
+ * Take empty pages of size class BLKTYPE off the lists until only KEEP
+ * are left, or MAX have been taken, and put their addresses in PAGES.
+ * Returns how many there are, to hand to subpage_release once the lock
+ * is let go.
+ */
+static
+unsigned
+subpage_trim(unsigned blktype, unsigned keep, vaddr_t *pages, unsigned max)
+{
+	struct pageref *pr, *next;
+	unsigned n = 0;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	for (pr = sizebases[blktype];
+	     pr != NULL && nemptypages[blktype] > keep && n < max;
+	     pr = next) {
+		next = pr->next_samesize;
+		if (pr->nfree != PAGE_SIZE / sizes[blktype] ||
+		    cm_kpage_tag(PR_PAGEADDR(pr)) == 0) {
+			continue;
+		}
+		pages[n++] = PR_PAGEADDR(pr);
+		remove_lists(pr, blktype);
+		freepageref(pr);
+		nemptypages[blktype]--;
+	}
+	pages_returned += n;
+	return n;
+}
+
+/*
+ * Give pages taken off the lists by subpage_trim back to the coremap.
+ */
+static
+void
+subpage_release(vaddr_t *pages, unsigned n)
+{
+	unsigned i;
+
+	KASSERT(!spinlock_do_i_hold(&kmalloc_spinlock));
+
+	for (i=0; i<n; i++) {
+		cm_kpage_settag(pages[i], 0);
+		free_kpages(pages[i]);
+	}
+}
+
 static
 void *
 subpage_kmalloc(size_t sz)
@@ -420,6 +526,10 @@ subpage_kmalloc(size_t sz)
 		checksubpage(pr);
 
 		if (pr->nfree > 0) {
+			if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
+				/* Taking a kept empty page back into use */
+				subpage_countempty(pr, blktype, -1);
+			}
 
 		doalloc: /* comes here after getting a whole fresh page */
 
@@ -466,12 +576,15 @@ subpage_kmalloc(size_t sz)
 		kprintf("kmalloc: Subpage allocator couldn't get a page\n"); 
 		return NULL;
 	}
+	/* Lets kfree find the size class without the lock (see below) */
+	cm_kpage_settag(prpage, blktype + 1);
 	spinlock_acquire(&kmalloc_spinlock);
 
 	pr = allocpageref();
 	if (pr==NULL) {
 		/* Couldn't allocate accounting space for the new page. */
 		spinlock_release(&kmalloc_spinlock);
+		cm_kpage_settag(prpage, 0);
 		free_kpages(prpage);
 		kprintf("kmalloc: Subpage allocator couldn't get pageref\n"); 
 		return NULL;
@@ -576,11 +689,20 @@ subpage_kfree(void *ptr)
 	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
 	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
 		/* Whole page is free. */
-		remove_lists(pr, blktype);
-		freepageref(pr);
-		/* Call free_kpages without kmalloc_spinlock. */
-		spinlock_release(&kmalloc_spinlock);
-		free_kpages(prpage);
+		subpage_countempty(pr, blktype, 1);
+		if (nemptypages[blktype] > EMPTY_PAGES_HIGH) {
+			vaddr_t pages[EMPTY_PAGES_HIGH + 1];
+			unsigned n;
+
+			n = subpage_trim(blktype, EMPTY_PAGES_LOW, pages,
+					 EMPTY_PAGES_HIGH + 1);
+			/* Call free_kpages without kmalloc_spinlock. */
+			spinlock_release(&kmalloc_spinlock);
+			subpage_release(pages, n);
+		}
+		else {
+			spinlock_release(&kmalloc_spinlock);
+		}
 	}
 	else {
 		spinlock_release(&kmalloc_spinlock);
@@ -598,9 +720,402 @@ subpage_kfree(void *ptr)
 //
 ////////////////////////////////////////////////////////////
 
+////////////////////////////////////////////////////////////
+//
+// Per-cpu magazines.
+//
+//    In front of the subpage allocator, each cpu keeps two magazines
+//    of free blocks for each size class (c_kmalloc_loaded and
+//    c_kmalloc_previous in struct cpu), which only that cpu touches,
+//    with interrupts off. Most kmallocs and kfrees just pop a block
+//    off or push one onto the loaded magazine, swapping it with the
+//    previous one when it runs empty or full, without taking a lock.
+//    When both are empty (or both full) the cpu trades one with the
+//    depot, which keeps full and empty magazines for each size class
+//    under kmalloc_depot_lock. Only when the depot has nothing to
+//    trade do we go to the pages and kmalloc_spinlock.
+//
+//    kfree finds a block's size class from the tag the coremap keeps
+//    with its page, rather than by walking the page list. Pages
+//    allocated before the coremap existed can't be tagged, so their
+//    blocks always go the slow way.
+//
+//    A cpu is given its pair of magazines the first time it misses,
+//    and spare empty ones go to the depot on later misses, up to a
+//    limit per size class. Magazines are never freed. The big size
+//    classes get fewer rounds, so a full magazine holds at most about
+//    a quarter of a page.
+//
+
+#define KMAG_ROUNDS 14	/* makes a magazine 64 bytes */
+#define KMAG_SPARE 4	/* magazines per size class beyond 2 per cpu */
+
+#if NSIZES != CPU_KMALLOC_NSIZES
+#error "CPU_KMALLOC_NSIZES doesn't match the subpage size classes"
+#endif
+
+struct kmalloc_magazine {
+	struct kmalloc_magazine *next;
+	unsigned rounds;
+	void *objs[KMAG_ROUNDS];
+};
+
+static struct kmalloc_magazine *depot_full[NSIZES];
+static struct kmalloc_magazine *depot_empty[NSIZES];
+static unsigned depot_nmags[NSIZES];
+static unsigned depot_trades;
+static struct spinlock kmalloc_depot_lock = SPINLOCK_INITIALIZER;
+
+static
+inline
+unsigned
+kmag_capacity(unsigned blktype)
+{
+	unsigned n = PAGE_SIZE / 4 / sizes[blktype];
+
+	if (n < 1) {
+		return 1;
+	}
+	return n < KMAG_ROUNDS ? n : KMAG_ROUNDS;
+}
+
+/*
+ * Give MAG to the depot list GIVE and take a magazine off TAKE in
+ * return. If TAKE is empty, nothing changes and NULL comes back.
+ */
+static
+struct kmalloc_magazine *
+depot_trade(struct kmalloc_magazine **give, struct kmalloc_magazine **take,
+	    struct kmalloc_magazine *mag)
+{
+	struct kmalloc_magazine *got;
+
+	spinlock_acquire(&kmalloc_depot_lock);
+	got = *take;
+	if (got != NULL) {
+		*take = got->next;
+		mag->next = *give;
+		*give = mag;
+		depot_trades++;
+	}
+	spinlock_release(&kmalloc_depot_lock);
+	return got;
+}
+
+/*
+ * Get a new empty magazine, unless the size class has enough already.
+ */
+static
+struct kmalloc_magazine *
+kmag_create(unsigned blktype)
+{
+	struct kmalloc_magazine *mag;
+
+	spinlock_acquire(&kmalloc_depot_lock);
+	if (depot_nmags[blktype] >= 2 * cpu_count() + KMAG_SPARE) {
+		spinlock_release(&kmalloc_depot_lock);
+		return NULL;
+	}
+	depot_nmags[blktype]++;
+	spinlock_release(&kmalloc_depot_lock);
+
+	/* Straight from the pages, so we don't come back in here */
+	mag = subpage_kmalloc(sizeof(*mag));
+	if (mag == NULL) {
+		spinlock_acquire(&kmalloc_depot_lock);
+		depot_nmags[blktype]--;
+		spinlock_release(&kmalloc_depot_lock);
+		return NULL;
+	}
+	mag->next = NULL;
+	mag->rounds = 0;
+	return mag;
+}
+
+static
+void
+kmag_put_empty(unsigned blktype, struct kmalloc_magazine *mag)
+{
+	KASSERT(mag->rounds == 0);
+
+	spinlock_acquire(&kmalloc_depot_lock);
+	mag->next = depot_empty[blktype];
+	depot_empty[blktype] = mag;
+	spinlock_release(&kmalloc_depot_lock);
+}
+
+/*
+ * Take a block of size class BLKTYPE from this cpu's magazines, or
+ * from a full one in the depot. Returns NULL if there isn't one.
+ */
+static
+void *
+magazine_alloc(unsigned blktype)
+{
+	struct cpu *c;
+	struct kmalloc_magazine *mag, *prev, *full;
+	void *ptr = NULL;
+	int spl;
+
+	if (!CURCPU_EXISTS()) {
+		return NULL;
+	}
+
+	spl = splhigh();
+	c = curcpu->c_self;
+	mag = c->c_kmalloc_loaded[blktype];
+	prev = c->c_kmalloc_previous[blktype];
+	if (mag != NULL && mag->rounds == 0) {
+		if (prev->rounds > 0) {
+			c->c_kmalloc_loaded[blktype] = prev;
+			c->c_kmalloc_previous[blktype] = mag;
+			mag = prev;
+		}
+		else {
+			full = depot_trade(&depot_empty[blktype],
+					   &depot_full[blktype], prev);
+			if (full != NULL) {
+				c->c_kmalloc_loaded[blktype] = full;
+				c->c_kmalloc_previous[blktype] = mag;
+				mag = full;
+			}
+		}
+	}
+
+	if (mag != NULL && mag->rounds > 0) {
+		ptr = mag->objs[--mag->rounds];
+		c->c_kmalloc_hits++;
+	}
+	else {
+		c->c_kmalloc_misses++;
+	}
+	splx(spl);
+	return ptr;
+}
+
+/*
+ * Put a free block of size class BLKTYPE in this cpu's magazines, or
+ * trade for an empty one from the depot to put it in. Returns false
+ * if there's no room anywhere.
+ */
+static
+bool
+magazine_free(void *ptr, unsigned blktype)
+{
+	struct cpu *c;
+	struct kmalloc_magazine *mag, *prev, *empty;
+	unsigned capacity = kmag_capacity(blktype);
+	bool done = false;
+	int spl;
+
+	if (!CURCPU_EXISTS()) {
+		return false;
+	}
+
+	spl = splhigh();
+	c = curcpu->c_self;
+	mag = c->c_kmalloc_loaded[blktype];
+	prev = c->c_kmalloc_previous[blktype];
+	if (mag != NULL && mag->rounds == capacity) {
+		if (prev->rounds < capacity) {
+			c->c_kmalloc_loaded[blktype] = prev;
+			c->c_kmalloc_previous[blktype] = mag;
+			mag = prev;
+		}
+		else {
+			empty = depot_trade(&depot_full[blktype],
+					    &depot_empty[blktype], prev);
+			if (empty != NULL) {
+				c->c_kmalloc_loaded[blktype] = empty;
+				c->c_kmalloc_previous[blktype] = mag;
+				mag = empty;
+			}
+		}
+	}
+
+	if (mag != NULL && mag->rounds < capacity) {
+		mag->objs[mag->rounds++] = ptr;
+		c->c_kmalloc_hits++;
+		done = true;
+	}
+	else {
+		c->c_kmalloc_misses++;
+	}
+	splx(spl);
+	return done;
+}
+
+/*
+ * After a miss, give this cpu its magazines for BLKTYPE if it has
+ * none yet, or else make sure the depot has an empty one for the
+ * next time a cpu fills up both of its own.
+ */
+static
+void
+magazine_miss(unsigned blktype)
+{
+	struct cpu *c;
+	struct kmalloc_magazine *loaded, *prev;
+	bool need_pair, need_spare;
+	int spl;
+
+	if (!CURCPU_EXISTS()) {
+		return;
+	}
+
+	spl = splhigh();
+	need_pair = curcpu->c_kmalloc_loaded[blktype] == NULL;
+	splx(spl);
+
+	if (need_pair) {
+		loaded = kmag_create(blktype);
+		prev = kmag_create(blktype);
+
+		spl = splhigh();
+		c = curcpu->c_self;
+		if (loaded != NULL && prev != NULL &&
+		    c->c_kmalloc_loaded[blktype] == NULL) {
+			c->c_kmalloc_loaded[blktype] = loaded;
+			c->c_kmalloc_previous[blktype] = prev;
+			loaded = prev = NULL;
+		}
+		splx(spl);
+
+		/* Whatever didn't get used can still go to the depot */
+		if (loaded != NULL) {
+			kmag_put_empty(blktype, loaded);
+		}
+		if (prev != NULL) {
+			kmag_put_empty(blktype, prev);
+		}
+		return;
+	}
+
+	spinlock_acquire(&kmalloc_depot_lock);
+	need_spare = depot_empty[blktype] == NULL;
+	spinlock_release(&kmalloc_depot_lock);
+
+	if (need_spare) {
+		loaded = kmag_create(blktype);
+		if (loaded != NULL) {
+			kmag_put_empty(blktype, loaded);
+		}
+	}
+}
+
+static
+void
+magazine_printstats(void)
+{
+	struct cpu *c;
+	unsigned i;
+
+	for (i=0; i<cpu_count(); i++) {
+		c = cpu_get(i);
+		kprintf("cpu%u: kmalloc magazine hits %u/%u\n", c->c_number,
+			c->c_kmalloc_hits,
+			c->c_kmalloc_hits + c->c_kmalloc_misses);
+	}
+	kprintf("kmalloc depot trades: %u\n", depot_trades);
+}
+
+/*
+ * Give the blocks in MAG back to the subpage allocator.
+ */
+static
+void
+magazine_drain(struct kmalloc_magazine *mag)
+{
+	while (mag->rounds > 0) {
+		subpage_kfree(mag->objs[--mag->rounds]);
+	}
+}
+
+/*
+ * Empty this cpu's magazines and the full ones in the depot, so the
+ * pages under them can become free. Other cpus' magazines stay as they
+ * are; this cpu can't safely touch them.
+ */
+static
+void
+magazine_reclaim(void)
+{
+	struct kmalloc_magazine local, *mag;
+	unsigned blktype, which;
+	int spl;
+
+	for (blktype=0; blktype<NSIZES; blktype++) {
+		for (which=0; which<2 && CURCPU_EXISTS(); which++) {
+			spl = splhigh();
+			mag = which == 0 ?
+				curcpu->c_kmalloc_loaded[blktype] :
+				curcpu->c_kmalloc_previous[blktype];
+			local.rounds = 0;
+			if (mag != NULL) {
+				local.rounds = mag->rounds;
+				memcpy(local.objs, mag->objs,
+				       mag->rounds * sizeof(mag->objs[0]));
+				mag->rounds = 0;
+			}
+			splx(spl);
+			magazine_drain(&local);
+		}
+
+		while (1) {
+			spinlock_acquire(&kmalloc_depot_lock);
+			mag = depot_full[blktype];
+			if (mag != NULL) {
+				depot_full[blktype] = mag->next;
+			}
+			spinlock_release(&kmalloc_depot_lock);
+			if (mag == NULL) {
+				break;
+			}
+			magazine_drain(mag);
+			kmag_put_empty(blktype, mag);
+		}
+	}
+}
+
+/*
+ * Called when the coremap runs short: empty the object caches, drain
+ * what magazines we can, and give back every empty page. The caches go
+ * first, since what they free lands in the magazines. Returns how many
+ * pages went back.
+ */
+unsigned
+kheap_reclaim(void)
+{
+	vaddr_t pages[EMPTY_PAGES_HIGH + 1];
+	unsigned blktype, n, total = 0;
+
+	kmem_cache_reclaim_all();
+	magazine_reclaim();
+
+	for (blktype=0; blktype<NSIZES; blktype++) {
+		do {
+			spinlock_acquire(&kmalloc_spinlock);
+			n = subpage_trim(blktype, 0, pages,
+					 EMPTY_PAGES_HIGH + 1);
+			spinlock_release(&kmalloc_spinlock);
+			subpage_release(pages, n);
+			total += n;
+		} while (n == EMPTY_PAGES_HIGH + 1);
+	}
+
+	DEBUG(DB_VM, "kmalloc: reclaimed %u pages\n", total);
+	return total;
+}
+
+//
+////////////////////////////////////////////////////////////
+
 void *
 kmalloc(size_t sz)
 {
+	unsigned blktype;
+	void *ptr;
+
 	if (sz>=LARGEST_SUBPAGE_SIZE) {
 		unsigned long npages;
 		vaddr_t address;
@@ -612,21 +1127,61 @@ kmalloc(size_t sz)
 			return NULL;
 		}
 
+#if OPT_KMPROFILE
+		kmprofile_alloc((void *)address, sz, npages * PAGE_SIZE,
+				(vaddr_t)__builtin_return_address(0));
+#endif
 		return (void *)address;
 	}
 
-	return subpage_kmalloc(sz);
+	blktype = blocktype(sz);
+	ptr = magazine_alloc(blktype);
+	if (ptr == NULL) {
+		magazine_miss(blktype);
+		ptr = subpage_kmalloc(sz);
+	}
+#if OPT_KMPROFILE
+	kmprofile_alloc(ptr, sz, sizes[blktype],
+			(vaddr_t)__builtin_return_address(0));
+#endif
+	return ptr;
 }
 
 void
 kfree(void *ptr)
 {
+	uint32_t tag;
+	unsigned blktype;
+
+	if (ptr == NULL) {
+		return;
+	}
+
+#if OPT_KMPROFILE
+	kmprofile_free(ptr);
+#endif
+
+	/*
+	 * A tagged page is one of ours, and the tag is its size class
+	 * plus one; try to keep the block in the magazines.
+	 */
+	tag = cm_kpage_tag((vaddr_t)ptr);
+	if (tag != 0) {
+		blktype = tag - 1;
+		KASSERT(blktype < NSIZES);
+		if (((vaddr_t)ptr & ~PAGE_FRAME) % sizes[blktype] != 0) {
+			panic("kfree: subpage free of invalid addr %p\n", ptr);
+		}
+		fill_deadbeef(ptr, sizes[blktype]);
+		if (magazine_free(ptr, blktype)) {
+			return;
+		}
+	}
+
 	/*
 	 * Try subpage first; if that fails, assume it's a big allocation.
 	 */
-	if (ptr == NULL) {
-		return;
-	} else if (subpage_kfree(ptr)) {
+	if (subpage_kfree(ptr)) {
 		KASSERT((vaddr_t)ptr%PAGE_SIZE==0);
         DEBUG(DB_VM, "KFREE CALLED");
 		free_kpages((vaddr_t)ptr);
@@ -0,0 +1,113 @@
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include "kmem_cache.h"
+
+// Every cache that has been used, for the stats. Caches are static
+// and never go away, so the list only grows.
+static struct kmem_cache *cacheList = NULL;
+static struct spinlock cacheListLock = SPINLOCK_INITIALIZER;
+
+static void kmem_cache_list(struct kmem_cache *cache)
+{
+    spinlock_acquire(&cacheListLock);
+    if (!cache->listed) {
+        cache->next = cacheList;
+        cacheList = cache;
+        cache->listed = true;
+    }
+    spinlock_release(&cacheListLock);
+}
+
+void *kmem_cache_alloc(struct kmem_cache *cache)
+{
+    void *obj;
+
+    spinlock_acquire(&cache->lock);
+    if (cache->count > 0) {
+        obj = cache->objs[--cache->count];
+        cache->hits++;
+        spinlock_release(&cache->lock);
+        return obj;
+    }
+    cache->misses++;
+    spinlock_release(&cache->lock);
+
+    if (!cache->listed) {
+        kmem_cache_list(cache);
+    }
+
+    obj = kmalloc(cache->size);
+    if (obj == NULL) {
+        return NULL;
+    }
+    if (cache->ctor != NULL && cache->ctor(obj) != 0) {
+        kfree(obj);
+        return NULL;
+    }
+    return obj;
+}
+
+void kmem_cache_free(struct kmem_cache *cache, void *obj)
+{
+    KASSERT(obj != NULL);
+    KASSERT(cache->max <= KMEM_CACHE_MAX);
+
+    spinlock_acquire(&cache->lock);
+    if (cache->count < cache->max) {
+        cache->objs[cache->count++] = obj;
+        spinlock_release(&cache->lock);
+        return;
+    }
+    spinlock_release(&cache->lock);
+
+    if (cache->dtor != NULL) {
+        cache->dtor(obj);
+    }
+    kfree(obj);
+}
+
+unsigned kmem_cache_reclaim_all(void)
+{
+    struct kmem_cache *cache;
+    void *objs[KMEM_CACHE_MAX];
+    unsigned n, total = 0;
+
+    spinlock_acquire(&cacheListLock);
+    cache = cacheList;
+    spinlock_release(&cacheListLock);
+
+    for (; cache != NULL; cache = cache->next) {
+        // Empty the cache first, so the destructors run without its lock
+        spinlock_acquire(&cache->lock);
+        n = cache->count;
+        for (unsigned i = 0; i < n; i++) {
+            objs[i] = cache->objs[i];
+        }
+        cache->count = 0;
+        spinlock_release(&cache->lock);
+
+        for (unsigned i = 0; i < n; i++) {
+            if (cache->dtor != NULL) {
+                cache->dtor(objs[i]);
+            }
+            kfree(objs[i]);
+        }
+        total += n;
+    }
+    return total;
+}
+
+void kmem_cache_printstats(void)
+{
+    struct kmem_cache *cache;
+
+    spinlock_acquire(&cacheListLock);
+    cache = cacheList;
+    spinlock_release(&cacheListLock);
+
+    for (; cache != NULL; cache = cache->next) {
+        kprintf("kmem_cache %s: %u cached, hits %u/%u\n", cache->name,
+                cache->count, cache->hits, cache->hits + cache->misses);
+    }
+}
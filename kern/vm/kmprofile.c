@@ -0,0 +1,256 @@
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <cpu.h>
+#include <current.h>
+#include <clock.h>
+#include "kmprofile.h"
+
+/*
+ * Two fixed-size hash tables, so that the profiler never allocates:
+ * call sites, keyed by caller and size class, and the blocks currently
+ * allocated, keyed by address, which remember their site for kfree.
+ * Both use linear probing. If either one fills up, the overflow is
+ * counted and not tracked.
+ *
+ * Times are in hardclocks of whichever cpu is running. The cpus' counts
+ * drift apart a little, which doesn't matter at the rates this is meant
+ * to find.
+ */
+
+#define KMP_NSITES 256          // Both powers of two
+#define KMP_NLIVE 2048
+#define KMP_TOP 10              // Callers shown in each list
+
+struct kmp_site {
+    vaddr_t caller;             // 0 for an unused slot
+    size_t blockSize;
+    unsigned allocs;            // Since the last reset
+    unsigned firstTick;         // Of the first allocation since the reset
+    unsigned lastTick;
+    unsigned liveBlocks;
+    size_t liveBytes;
+};
+
+struct kmp_block {
+    vaddr_t ptr;                // 0 for an unused slot
+    uint32_t size;
+    uint32_t site;
+};
+
+static struct kmp_site kmpSites[KMP_NSITES];
+static struct kmp_block kmpBlocks[KMP_NLIVE];
+static unsigned kmpStartTick = 0;
+static unsigned kmpSitesFull = 0;       // Allocations with no site slot
+static unsigned kmpBlocksFull = 0;      // Allocations with no block slot
+static struct spinlock kmpLock = SPINLOCK_INITIALIZER;
+
+static unsigned kmp_now(void)
+{
+    return CURCPU_EXISTS() ? curcpu->c_hardclocks : 0;
+}
+
+// Ticks from then to now, or 0 if the cpus' clocks disagree about the order
+static unsigned kmp_since(unsigned now, unsigned then)
+{
+    return (int)(now - then) > 0 ? now - then : 0;
+}
+
+static unsigned kmp_site_hash(vaddr_t caller, size_t blockSize)
+{
+    return ((caller >> 2) * 2654435761u ^ blockSize) % KMP_NSITES;
+}
+
+static unsigned kmp_block_hash(vaddr_t ptr)
+{
+    return ((ptr >> 4) * 2654435761u) % KMP_NLIVE;
+}
+
+static struct kmp_site *kmp_site_get(vaddr_t caller, size_t blockSize)
+{
+    unsigned start = kmp_site_hash(caller, blockSize);
+
+    KASSERT(spinlock_do_i_hold(&kmpLock));
+
+    for (unsigned n = 0; n < KMP_NSITES; n++) {
+        struct kmp_site *site = &kmpSites[(start + n) % KMP_NSITES];
+        if (site->caller == 0) {
+            site->caller = caller;
+            site->blockSize = blockSize;
+            return site;
+        }
+        if (site->caller == caller && site->blockSize == blockSize) {
+            return site;
+        }
+    }
+    return NULL;
+}
+
+static int kmp_block_find(vaddr_t ptr)
+{
+    unsigned start = kmp_block_hash(ptr);
+
+    KASSERT(spinlock_do_i_hold(&kmpLock));
+
+    for (unsigned n = 0; n < KMP_NLIVE; n++) {
+        unsigned i = (start + n) % KMP_NLIVE;
+        if (kmpBlocks[i].ptr == ptr) {
+            return i;
+        }
+        if (kmpBlocks[i].ptr == 0) {
+            break;
+        }
+    }
+    return -1;
+}
+
+// Empty slot i, moving later entries of its probe run back so lookups
+// still find them without tombstones
+static void kmp_block_remove(unsigned i)
+{
+    unsigned j = i;
+
+    while (1) {
+        kmpBlocks[i].ptr = 0;
+        while (1) {
+            j = (j + 1) % KMP_NLIVE;
+            if (kmpBlocks[j].ptr == 0) {
+                return;
+            }
+            unsigned home = kmp_block_hash(kmpBlocks[j].ptr);
+            // Leave entries whose home lies cyclically in (i, j]
+            bool stays = i <= j ? (i < home && home <= j) : (i < home || home <= j);
+            if (!stays) {
+                break;
+            }
+        }
+        kmpBlocks[i] = kmpBlocks[j];
+        i = j;
+    }
+}
+
+void kmprofile_alloc(void *ptr, size_t size, size_t blockSize, vaddr_t caller)
+{
+    if (ptr == NULL) {
+        return;
+    }
+
+    spinlock_acquire(&kmpLock);
+    struct kmp_site *site = kmp_site_get(caller, blockSize);
+    if (site == NULL) {
+        kmpSitesFull++;
+        spinlock_release(&kmpLock);
+        return;
+    }
+
+    unsigned now = kmp_now();
+    if (site->allocs == 0) {
+        site->firstTick = now;
+    }
+    site->lastTick = now;
+    site->allocs++;
+
+    unsigned start = kmp_block_hash((vaddr_t)ptr);
+    for (unsigned n = 0; n < KMP_NLIVE; n++) {
+        struct kmp_block *block = &kmpBlocks[(start + n) % KMP_NLIVE];
+        if (block->ptr == 0) {
+            block->ptr = (vaddr_t)ptr;
+            block->size = size;
+            block->site = site - kmpSites;
+            site->liveBlocks++;
+            site->liveBytes += size;
+            spinlock_release(&kmpLock);
+            return;
+        }
+    }
+    kmpBlocksFull++;
+    spinlock_release(&kmpLock);
+}
+
+void kmprofile_free(void *ptr)
+{
+    spinlock_acquire(&kmpLock);
+    int i = kmp_block_find((vaddr_t)ptr);
+    if (i >= 0) {
+        struct kmp_site *site = &kmpSites[kmpBlocks[i].site];
+        KASSERT(site->liveBlocks > 0);
+        site->liveBlocks--;
+        site->liveBytes -= kmpBlocks[i].size;
+        kmp_block_remove(i);
+    }
+    spinlock_release(&kmpLock);
+}
+
+// Allocations per second over the time the site has been allocating
+static unsigned kmp_rate(struct kmp_site *site, unsigned now)
+{
+    unsigned ticks = kmp_since(now, site->firstTick);
+    if (site->allocs == 0 || ticks == 0) {
+        return site->allocs;
+    }
+    return (unsigned)((uint64_t)site->allocs * HZ / ticks);
+}
+
+static void kmp_print_top(const char *title, bool byRate, unsigned now)
+{
+    bool shown[KMP_NSITES];
+
+    KASSERT(spinlock_do_i_hold(&kmpLock));
+
+    bzero(shown, sizeof(shown));
+    kprintf("%s:\n", title);
+    kprintf("  %-10s %5s %7s %8s %8s %7s %6s\n", "caller", "size",
+            "blocks", "bytes", "allocs", "per sec", "idle");
+
+    for (unsigned n = 0; n < KMP_TOP; n++) {
+        int best = -1;
+        unsigned bestKey = 0;
+        for (unsigned i = 0; i < KMP_NSITES; i++) {
+            struct kmp_site *site = &kmpSites[i];
+            if (site->caller == 0 || shown[i]) {
+                continue;
+            }
+            unsigned key = byRate ? kmp_rate(site, now) : site->liveBytes;
+            if (key > 0 && (best < 0 || key > bestKey)) {
+                best = i;
+                bestKey = key;
+            }
+        }
+        if (best < 0) {
+            break;
+        }
+
+        struct kmp_site *site = &kmpSites[best];
+        shown[best] = true;
+        kprintf("  0x%08x %5u %7u %8u %8u %7u %5us\n", site->caller,
+                site->blockSize, site->liveBlocks, site->liveBytes,
+                site->allocs, kmp_rate(site, now),
+                site->allocs > 0 ? kmp_since(now, site->lastTick) / HZ : 0);
+    }
+}
+
+void kmprofile_print(bool reset)
+{
+    // Print the whole thing with interrupts off, like kheap_printstats
+    spinlock_acquire(&kmpLock);
+    unsigned now = kmp_now();
+
+    kprintf("kmalloc profile over %u seconds:\n",
+            kmp_since(now, kmpStartTick) / HZ);
+    kmp_print_top("Top callers by live bytes", false, now);
+    kmp_print_top("Top callers by allocation rate", true, now);
+    if (kmpSitesFull > 0 || kmpBlocksFull > 0) {
+        kprintf("Not tracked: %u allocations (sites full), %u blocks (table full)\n",
+                kmpSitesFull, kmpBlocksFull);
+    }
+
+    if (reset) {
+        for (unsigned i = 0; i < KMP_NSITES; i++) {
+            kmpSites[i].allocs = 0;
+        }
+        kmpSitesFull = 0;
+        kmpBlocksFull = 0;
+        kmpStartTick = now;
+    }
+    spinlock_release(&kmpLock);
+}
@@ -0,0 +1,230 @@
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <thread.h>
+#include <current.h>
+#include <vnode.h>
+#include <vm.h>
+#include "coremap.h"
+#include "pagecache.h"
+
+/*
+ * Read-only pages of executables, shared between every address space
+ * running the same binary. Each page is keyed by its vnode and file
+ * offset and holds one coremap reference of its own, on top of one per
+ * address space mapping it. A shared page never has an owner, so the
+ * clock leaves it alone. When memory runs short, pagecache_reclaim lets
+ * go of every page that at most one address space is still using, which
+ * frees it or makes it an ordinary private page the clock can evict.
+ *
+ * Pages of shared mappings are pinned: they stay cached for as long as
+ * anyone maps them, since a second copy would not see the first one's
+ * writes. Whoever unmaps them writes them back, so by the time only the
+ * cache holds one, the file is up to date and the page can just go.
+ *
+ * Each entry also holds a vnode reference, so a cached vnode can't be
+ * freed and its address reused for a different file.
+ *
+ * Nothing but shared mappings writes through the cache, so a file's
+ * pages are only good for as long as nobody else changes it. vfs_open
+ * calls pagecache_invalidate whenever a file is opened for writing,
+ * which covers truncation and every write made through a vnode from
+ * vfs_open. Address spaces already mapping the old pages keep them.
+ *
+ * Entries are keyed by page-aligned offsets only, so two of them never
+ * overlap.
+ */
+
+#define PC_NBUCKETS 64
+
+struct pc_entry {
+    struct vnode *vnode;
+    off_t offset;
+    paddr_t paddr;
+    bool pinned;
+    struct pc_entry *next;
+};
+
+static struct pc_entry *pcBuckets[PC_NBUCKETS];
+static struct spinlock pc_lock = SPINLOCK_INITIALIZER;
+static uint32_t numCachedPages = 0;
+static uint32_t pcHits = 0;
+static uint32_t pcMisses = 0;
+
+static unsigned pc_hash(struct vnode *vn, off_t offset)
+{
+    return (((uintptr_t)vn >> 4) ^ (uint32_t)(offset / PAGE_SIZE)) % PC_NBUCKETS;
+}
+
+static struct pc_entry *pc_find(struct vnode *vn, off_t offset)
+{
+    KASSERT(spinlock_do_i_hold(&pc_lock));
+
+    for (struct pc_entry *e = pcBuckets[pc_hash(vn, offset)]; e != NULL; e = e->next) {
+        if (e->vnode == vn && e->offset == offset) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+paddr_t pagecache_lookup(struct vnode *vn, off_t offset, bool pin)
+{
+    paddr_t paddr = 0;
+
+    KASSERT((offset & ~(off_t)PAGE_FRAME) == 0);
+
+    spinlock_acquire(&pc_lock);
+    struct pc_entry *e = pc_find(vn, offset);
+    if (e != NULL) {
+        // Cached pages are never evicted, so they can't be busy
+        bool ok = cm_page_incref(e->paddr);
+        KASSERT(ok);
+        (void)ok;
+        paddr = e->paddr;
+        e->pinned |= pin;
+        pcHits++;
+    } else {
+        pcMisses++;
+    }
+    spinlock_release(&pc_lock);
+
+    return paddr;
+}
+
+paddr_t pagecache_insert(struct vnode *vn, off_t offset, paddr_t paddr, bool pin)
+{
+    KASSERT((offset & ~(off_t)PAGE_FRAME) == 0);
+
+    struct pc_entry *e = kmalloc(sizeof(struct pc_entry));
+    if (e == NULL) {
+        return 0;
+    }
+    e->vnode = vn;
+    e->offset = offset;
+    e->paddr = paddr;
+    e->pinned = pin;
+
+    spinlock_acquire(&pc_lock);
+    struct pc_entry *other = pc_find(vn, offset);
+    if (other != NULL) {
+        // Somebody else read the same page at the same time
+        bool ok = cm_page_incref(other->paddr);
+        KASSERT(ok);
+        (void)ok;
+        other->pinned |= pin;
+        paddr = other->paddr;
+        spinlock_release(&pc_lock);
+        kfree(e);
+        return paddr;
+    }
+
+    // The caller still has the page to itself, so it can't be busy
+    bool ok = cm_page_incref(paddr);
+    KASSERT(ok);
+    (void)ok;
+    VOP_INCREF(vn);
+
+    unsigned bucket = pc_hash(vn, offset);
+    e->next = pcBuckets[bucket];
+    pcBuckets[bucket] = e;
+    numCachedPages++;
+    spinlock_release(&pc_lock);
+    return paddr;
+}
+
+/*
+ * Let go of the cache's references in the list DROPPED, which is no
+ * longer reachable from the buckets.
+ */
+static unsigned pc_release(struct pc_entry *dropped)
+{
+    unsigned count = 0;
+
+    while (dropped != NULL) {
+        struct pc_entry *e = dropped;
+        dropped = e->next;
+
+        bool ok = cm_page_decref(e->paddr, NULL);
+        KASSERT(ok);
+        (void)ok;
+        VOP_DECREF(e->vnode);
+        kfree(e);
+        count++;
+    }
+    return count;
+}
+
+void pagecache_invalidate(struct vnode *vn)
+{
+    struct pc_entry *dropped = NULL;
+
+    // The caller's own reference keeps vn alive through the decrefs
+    KASSERT(!curthread->t_in_interrupt);
+
+    spinlock_acquire(&pc_lock);
+    for (unsigned i = 0; i < PC_NBUCKETS; i++) {
+        struct pc_entry **prev = &pcBuckets[i];
+        while (*prev != NULL) {
+            struct pc_entry *e = *prev;
+            if (e->vnode == vn) {
+                *prev = e->next;
+                e->next = dropped;
+                dropped = e;
+                numCachedPages--;
+            } else {
+                prev = &e->next;
+            }
+        }
+    }
+    spinlock_release(&pc_lock);
+
+    unsigned count = pc_release(dropped);
+    if (count > 0) {
+        DEBUG(DB_VM, "pagecache: invalidated %u pages\n", count);
+    }
+}
+
+unsigned pagecache_reclaim(void)
+{
+    struct pc_entry *dropped = NULL;
+    unsigned count;
+
+    // Letting go of the last vnode reference can sleep on disk I/O
+    if (curthread->t_in_interrupt || curthread->t_curspl > 0) {
+        return 0;
+    }
+
+    /*
+     * The count can still change once the lock is dropped, but the
+     * cache's own reference keeps the page from being evicted or freed
+     * until the decref below.
+     */
+    spinlock_acquire(&pc_lock);
+    for (unsigned i = 0; i < PC_NBUCKETS; i++) {
+        struct pc_entry **prev = &pcBuckets[i];
+        while (*prev != NULL) {
+            struct pc_entry *e = *prev;
+            if (cm_page_refcount(e->paddr) <= (e->pinned ? 1u : 2u)) {
+                *prev = e->next;
+                e->next = dropped;
+                dropped = e;
+                numCachedPages--;
+            } else {
+                prev = &e->next;
+            }
+        }
+    }
+    spinlock_release(&pc_lock);
+
+    count = pc_release(dropped);
+
+    DEBUG(DB_VM, "pagecache: reclaimed %u pages\n", count);
+    return count;
+}
+
+void pagecache_printstats(void)
+{
+    kprintf("Page cache: %u pages, hits %u/%u\n", numCachedPages,
+            pcHits, pcHits + pcMisses);
+}
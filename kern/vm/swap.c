@@ -0,0 +1,151 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <bitmap.h>
+#include <spinlock.h>
+#include <uio.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <vm.h>
+#include "swap.h"
+
+/*
+ * Swap space is the whole of a raw disk, split into page sized slots.
+ * A bitmap tracks which slots are in use. The bitmap is protected by
+ * swap_lock; the disk does its own locking, so reads and writes of
+ * different slots can be in flight at the same time.
+ */
+
+static struct vnode *swapVnode = NULL;
+static struct bitmap *swapMap = NULL;
+static uint32_t numSwapSlots = 0;
+static struct spinlock swap_lock = SPINLOCK_INITIALIZER;
+
+void swap_bootstrap(void)
+{
+    char path[] = SWAP_DEVICE;
+    struct stat st;
+    int result;
+
+    result = vfs_open(path, O_RDWR, 0, &swapVnode);
+    if (result) {
+        kprintf("swap: can't open %s: %s, paging to disk disabled\n", SWAP_DEVICE, strerror(result));
+        swapVnode = NULL;
+        return;
+    }
+
+    result = VOP_STAT(swapVnode, &st);
+    if (result) {
+        panic("swap: can't stat %s: %s\n", SWAP_DEVICE, strerror(result));
+    }
+
+    numSwapSlots = st.st_size / PAGE_SIZE;
+    swapMap = bitmap_create(numSwapSlots);
+    if (swapMap == NULL) {
+        panic("swap: can't allocate map for %u slots\n", numSwapSlots);
+    }
+
+    kprintf("swap: %u pages on %s\n", numSwapSlots, SWAP_DEVICE);
+}
+
+static int swap_alloc(uint32_t *slot)
+{
+    unsigned index;
+    int result;
+
+    if (swapMap == NULL) {
+        return ENOSPC;
+    }
+
+    spinlock_acquire(&swap_lock);
+    result = bitmap_alloc(swapMap, &index);
+    spinlock_release(&swap_lock);
+
+    if (result) {
+        DEBUG(DB_VM, "swap: out of swap space\n");
+        return ENOSPC;
+    }
+    *slot = index;
+    return 0;
+}
+
+void swap_free(uint32_t slot)
+{
+    KASSERT(slot < numSwapSlots);
+
+    spinlock_acquire(&swap_lock);
+    KASSERT(bitmap_isset(swapMap, slot));
+    bitmap_unmark(swapMap, slot);
+    spinlock_release(&swap_lock);
+}
+
+static int swap_io(uint32_t slot, void *kbuf, enum uio_rw rw)
+{
+    struct iovec iov;
+    struct uio u;
+    int result;
+
+    KASSERT(slot < numSwapSlots);
+
+    uio_kinit(&iov, &u, kbuf, PAGE_SIZE, (off_t)slot * PAGE_SIZE, rw);
+    if (rw == UIO_READ) {
+        result = VOP_READ(swapVnode, &u);
+    } else {
+        result = VOP_WRITE(swapVnode, &u);
+    }
+    if (result == 0 && u.uio_resid != 0) {
+        result = EIO;
+    }
+    if (result) {
+        kprintf("swap: %s of slot %u failed: %s\n", rw == UIO_READ ? "read" : "write", slot, strerror(result));
+    }
+    return result;
+}
+
+int swap_out(paddr_t paddr, uint32_t *slot)
+{
+    int result;
+
+    result = swap_alloc(slot);
+    if (result) {
+        return result;
+    }
+
+    result = swap_io(*slot, (void *)PADDR_TO_KVADDR(paddr), UIO_WRITE);
+    if (result) {
+        swap_free(*slot);
+    }
+    return result;
+}
+
+int swap_in(uint32_t slot, paddr_t paddr)
+{
+    return swap_io(slot, (void *)PADDR_TO_KVADDR(paddr), UIO_READ);
+}
+
+int swap_copy(uint32_t slot, uint32_t *newSlot)
+{
+    void *buffer;
+    int result;
+
+    buffer = kmalloc(PAGE_SIZE);
+    if (buffer == NULL) {
+        return ENOMEM;
+    }
+
+    result = swap_alloc(newSlot);
+    if (result == 0) {
+        result = swap_io(slot, buffer, UIO_READ);
+        if (result == 0) {
+            result = swap_io(*newSlot, buffer, UIO_WRITE);
+        }
+        if (result) {
+            swap_free(*newSlot);
+        }
+    }
+
+    kfree(buffer);
+    return result;
+}
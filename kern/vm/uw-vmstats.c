@@ -8,17 +8,29 @@
  * (i.e., outside of these routines) by acquiring stats_lock.
  * All of the functions whose names do not begin
  * with '_' ensure atomicity locally.
+ * The exception is the increments, which only touch the
+ * current cpu's counters and take no lock: vmstats_inc
+ * turns interrupts off itself, and _vmstats_inc assumes
+ * they are already off.
+ */
+
+/*
+ * The counters live in struct cpu (c_vmstats), and each cpu only ever
+ * bumps its own with interrupts off, so counting takes no lock and
+ * never bounces a cache line between cpus. They are only added up when
+ * somebody asks for the totals. stats_lock just keeps two snapshots or
+ * resets from running at once; a reset can lose the odd count another
+ * cpu makes while it runs.
  */
 
 #include <types.h>
 #include <lib.h>
 #include <synch.h>
 #include <spl.h>
+#include <cpu.h>
+#include <current.h>
 #include <uw-vmstats.h>
 
-/* Counters for tracking statistics */
-static unsigned int stats_counts[VMSTAT_COUNT];
-
 struct spinlock stats_lock = SPINLOCK_INITIALIZER;
 
 /* Strings used in printing out the statistics */
@@ -33,6 +45,7 @@ static const char *stats_names[] = {
  /*  7 */ "Page Faults from ELF",
  /*  8 */ "Page Faults from Swapfile",
  /*  9 */ "Swapfile Writes",
+ /* 10 */ "Page Faults (Page Cache)",
 };
 
 
@@ -41,9 +54,14 @@ static const char *stats_names[] = {
 void
 vmstats_inc(unsigned int index)
 {
-    spinlock_acquire(&stats_lock);
-      _vmstats_inc(index);
-    spinlock_release(&stats_lock);
+  int spl;
+
+  KASSERT(index < VMSTAT_COUNT);
+
+  /* Interrupts off so we can't be preempted onto another cpu midway */
+  spl = splhigh();
+  curcpu->c_vmstats[index]++;
+  splx(spl);
 }
 
 /* ---------------------------------------------------------------------- */
@@ -65,44 +83,79 @@ void
 _vmstats_inc(unsigned int index)
 {
   KASSERT(index < VMSTAT_COUNT);
-  stats_counts[index]++;
+  curcpu->c_vmstats[index]++;
 }
 
 /* ---------------------------------------------------------------------- */
 void
 _vmstats_init(void)
 {
-  int i = 0;
-
   if (sizeof(stats_names) / sizeof(char *) != VMSTAT_COUNT) {
     kprintf("vmstats_init: number of stats_names = %d != VMSTAT_COUNT = %d\n",
       (sizeof(stats_names) / sizeof(char *)), VMSTAT_COUNT);
     panic("Should really fix this before proceeding\n");
   }
 
-  for (i=0; i<VMSTAT_COUNT; i++) {
-    stats_counts[i] = 0;
+  _vmstats_snapshot(NULL, true);
+}
+
+/* ---------------------------------------------------------------------- */
+void
+vmstats_snapshot(unsigned int counts[VMSTAT_COUNT], bool reset)
+{
+  spinlock_acquire(&stats_lock);
+    _vmstats_snapshot(counts, reset);
+  spinlock_release(&stats_lock);
+}
+
+/* ---------------------------------------------------------------------- */
+void
+_vmstats_snapshot(unsigned int counts[VMSTAT_COUNT], bool reset)
+{
+  struct cpu *c;
+  unsigned i, j;
+
+  if (counts != NULL) {
+    for (j=0; j<VMSTAT_COUNT; j++) {
+      counts[j] = 0;
+    }
   }
 
+  for (i=0; i<cpu_count(); i++) {
+    c = cpu_get(i);
+    for (j=0; j<VMSTAT_COUNT; j++) {
+      if (counts != NULL) {
+        counts[j] += c->c_vmstats[j];
+      }
+      if (reset) {
+        c->c_vmstats[j] = 0;
+      }
+    }
+  }
 }
 
 /* ---------------------------------------------------------------------- */
 /* Assumes vmstat_init has already been called */
-/* NOTE: We do not grab the spinlock here because kprintf may block
- * and we can't block while holding a spinlock.
- * Just use this when there is only one thread remaining.
+/* NOTE: The totals are a snapshot taken under the spinlock, and
+ * printed after it has been let go, because kprintf may block and
+ * we can't block while holding a spinlock. Counts made while
+ * printing show up in the next snapshot.
  */
 
+static
 void
-vmstats_print(void)
+_vmstats_print(bool reset)
 {
+  unsigned int stats_counts[VMSTAT_COUNT];
   int i = 0;
   int free_plus_replace = 0;
-  int disk_plus_zeroed_plus_reload = 0;
+  int disk_plus_zeroed_plus_cached_plus_reload = 0;
   int tlb_faults = 0;
   int elf_plus_swap_reads = 0;
   int disk_reads = 0;
 
+  vmstats_snapshot(stats_counts, reset);
+
   kprintf("VMSTATS:\n");
   for (i=0; i<VMSTAT_COUNT; i++) {
     kprintf("VMSTAT %25s = %10d\n", stats_names[i], stats_counts[i]);
@@ -110,8 +163,9 @@ vmstats_print(void)
 
   tlb_faults = stats_counts[VMSTAT_TLB_FAULT];
   free_plus_replace = stats_counts[VMSTAT_TLB_FAULT_FREE] + stats_counts[VMSTAT_TLB_FAULT_REPLACE];
-  disk_plus_zeroed_plus_reload = stats_counts[VMSTAT_PAGE_FAULT_DISK] +
-    stats_counts[VMSTAT_PAGE_FAULT_ZERO] + stats_counts[VMSTAT_TLB_RELOAD];
+  disk_plus_zeroed_plus_cached_plus_reload = stats_counts[VMSTAT_PAGE_FAULT_DISK] +
+    stats_counts[VMSTAT_PAGE_FAULT_ZERO] + stats_counts[VMSTAT_PAGE_FAULT_CACHED] +
+    stats_counts[VMSTAT_TLB_RELOAD];
   elf_plus_swap_reads = stats_counts[VMSTAT_ELF_FILE_READ] + stats_counts[VMSTAT_SWAP_FILE_READ];
   disk_reads = stats_counts[VMSTAT_PAGE_FAULT_DISK];
 
@@ -121,11 +175,11 @@ vmstats_print(void)
       tlb_faults, free_plus_replace); 
   }
 
-  kprintf("VMSTAT TLB Reloads + Page Faults (Zeroed) + Page Faults (Disk) = %d\n",
-    disk_plus_zeroed_plus_reload);
-  if (tlb_faults != disk_plus_zeroed_plus_reload) {
-    kprintf("WARNING: TLB Faults (%d) != TLB Reloads + Page Faults (Zeroed) + Page Faults (Disk) (%d)\n",
-      tlb_faults, disk_plus_zeroed_plus_reload); 
+  kprintf("VMSTAT TLB Reloads + Page Faults (Zeroed) + Page Faults (Disk) + Page Faults (Page Cache) = %d\n",
+    disk_plus_zeroed_plus_cached_plus_reload);
+  if (tlb_faults != disk_plus_zeroed_plus_cached_plus_reload) {
+    kprintf("WARNING: TLB Faults (%d) != TLB Reloads + Page Faults (Zeroed) + Page Faults (Disk) + Page Faults (Page Cache) (%d)\n",
+      tlb_faults, disk_plus_zeroed_plus_cached_plus_reload); 
   }
 
   kprintf("VMSTAT ELF File reads + Swapfile reads = %d\n", elf_plus_swap_reads);
@@ -134,4 +188,21 @@ vmstats_print(void)
       elf_plus_swap_reads);
   }
 }
+
+/* ---------------------------------------------------------------------- */
+/* Prints the totals so far */
+void
+vmstats_print(void)
+{
+  _vmstats_print(false);
+}
+
+/* ---------------------------------------------------------------------- */
+/* Prints the totals so far and starts counting again from zero */
+void
+vmstats_print_reset(void)
+{
+  _vmstats_print(true);
+}
+
 /* ---------------------------------------------------------------------- */
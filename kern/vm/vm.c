@@ -0,0 +1,724 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spl.h>
+#include <proc.h>
+#include <cpu.h>
+#include <current.h>
+#include <uio.h>
+#include <vnode.h>
+#include <mips/tlb.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <coremap.h>
+#include <swap.h>
+#include <pagecache.h>
+#include <uw-vmstats.h>
+#include "opt-A3.h"
+
+/*
+ * Paging VM system.
+ *
+ * User pages are only given a frame when vm_fault first touches them.
+ * A page that overlaps the file image of its region is read from the
+ * executable at that point; anything else comes back zero filled.
+ * Read-only pages wholly inside the file image go through the page
+ * cache, so processes running the same executable share one copy, and
+ * so do the pages of shared file mappings.
+ *
+ * When memory runs out the coremap picks a victim and calls back into
+ * vm_evictpage. Dirty pages go to swap; clean ones are simply dropped
+ * and fetched again from the executable or zero filled. Pages are
+ * entered in the TLB read-only until they are written, which is how we
+ * know they are dirty.
+ */
+
+void
+vm_bootstrap(void)
+{
+    cm_bootstrap();
+    vmstats_init();
+    swap_bootstrap();
+    cm_zero_bootstrap();
+}
+
+bool
+vm_idle(void)
+{
+    return cm_idle();
+}
+
+void
+vm_shutdown(void)
+{
+    unsigned shootdowns = 0, ipis = 0, flushes = 0;
+    
+    /* Let go of the cached executables before their file systems go */
+    pagecache_reclaim();
+    
+    for (unsigned i = 0; i < cpu_count(); i++) {
+        struct cpu *c = cpu_get(i);
+        shootdowns += c->c_shootdowns;
+        ipis += c->c_shootdown_ipis;
+        flushes += c->c_shootdown_flushes;
+    }
+    
+    vmstats_print();
+    kprintf("VM: %u TLB shootdowns sent %u IPIs, %u flushed the whole TLB\n",
+            shootdowns, ipis, flushes);
+    as_stlb_printstats();
+    pagecache_printstats();
+}
+
+/* Allocate/free some kernel-space virtual pages */
+vaddr_t
+alloc_kpages(int npages)
+{
+    return cm_alloc_kpages(npages);
+}
+
+void
+free_kpages(vaddr_t addr)
+{
+    cm_free_kpages(addr);
+}
+
+void
+vm_tlbshootdown_all(void)
+{
+    int i, spl;
+    
+    spl = splhigh();
+    for (i=0; i<NUM_TLB; i++) {
+        tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+    }
+    curcpu->c_tlb_hand = 0;
+    vmstats_inc(VMSTAT_TLB_INVALIDATE);
+    splx(spl);
+}
+
+void
+vm_tlbshootdown(const struct tlbshootdown *ts)
+{
+    int i, spl;
+    
+    spl = splhigh();
+    i = tlb_probe(ts->ts_vaddr & PAGE_FRAME, 0);
+    if (i >= 0) {
+        tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+        vmstats_inc(VMSTAT_TLB_INVALIDATE);
+    }
+    splx(spl);
+}
+
+/*
+ * Invalidate the NPAGES pages from VADDR on in AS on every cpu that
+ * could be using them, and wait until that's done. More than
+ * TLBSHOOTDOWN_MAX pages flush the whole TLB instead.
+ *
+ * Every switch to an address space flushes the TLB, so only a cpu whose
+ * TLB last had AS loaded (c_tlb_as) can be holding its translations,
+ * and only one that is running AS right now can use them. If AS is ours
+ * it isn't running anywhere else, so this cpu is the only one to do.
+ * Otherwise a cpu may switch to AS just after we look, but it flushes
+ * when it does, and the caller has already taken the pages out of the
+ * page table and software TLB.
+ */
+void
+vm_tlbshootdown_pages(struct addrspace *as, vaddr_t vaddr, unsigned npages)
+{
+    struct tlbshootdown ts[TLBSHOOTDOWN_MAX];
+    struct cpu *c;
+    unsigned i, n, ipis;
+    bool local;
+    int spl;
+    
+    n = npages > TLBSHOOTDOWN_MAX ? TLBSHOOTDOWN_MAX : npages;
+    for (i=0; i<n; i++) {
+        ts[i].ts_addrspace = as;
+        ts[i].ts_vaddr = vaddr + i * PAGE_SIZE;
+    }
+    
+    spl = splhigh();
+    if (npages > TLBSHOOTDOWN_MAX) {
+        vm_tlbshootdown_all();
+    }
+    else {
+        for (i=0; i<n; i++) {
+            vm_tlbshootdown(&ts[i]);
+        }
+    }
+    splx(spl);
+    
+    local = (as == curproc_getas());
+    ipis = 0;
+    for (i=0; i<cpu_count() && !local; i++) {
+        c = cpu_get(i);
+        spl = splhigh();
+        if (c == curcpu->c_self || c->c_tlb_as != as) {
+            splx(spl);
+            continue;
+        }
+        splx(spl);
+        ipi_tlbshootdown_wait(c, ts, npages);
+        ipis++;
+    }
+    
+    spl = splhigh();
+    curcpu->c_shootdowns++;
+    curcpu->c_shootdown_ipis += ipis;
+    if (npages > TLBSHOOTDOWN_MAX) {
+        curcpu->c_shootdown_flushes++;
+    }
+    splx(spl);
+}
+
+/*
+ * Enter a mapping in AS for a TLB miss. The caller holds as_lock.
+ *
+ * Each cpu refills its TLB round robin, so the slot we take is the one
+ * refilled longest ago; after a flush that fills the free slots in
+ * order. A slot whose page keeps having to be refilled gets passed
+ * over, up to VM_TLB_MAXSKIP times per miss, since it's likely in use.
+ */
+#define VM_TLB_MAXSKIP 4
+
+static
+void
+vm_tlb_install(struct addrspace *as, uint32_t ehi, uint32_t elo)
+{
+    uint32_t oldehi, oldelo;
+    unsigned slot, skipped;
+    
+    KASSERT(spinlock_do_i_hold(&as->as_lock));
+    
+    vmstats_inc(VMSTAT_TLB_FAULT);
+    for (skipped = 0; ; skipped++) {
+        slot = curcpu->c_tlb_hand;
+        curcpu->c_tlb_hand = (slot + 1) % NUM_TLB;
+        
+        tlb_read(&oldehi, &oldelo, slot);
+        if (!(oldelo & TLBLO_VALID)) {
+            vmstats_inc(VMSTAT_TLB_FAULT_FREE);
+            break;
+        }
+        if (skipped == VM_TLB_MAXSKIP ||
+            !as_stlb_hot(as, oldehi & TLBHI_VPAGE)) {
+            vmstats_inc(VMSTAT_TLB_FAULT_REPLACE);
+            break;
+        }
+    }
+    tlb_write(ehi, elo, slot);
+}
+
+/*
+ * Replace the mapping for EHI if it's still in the TLB. The caller has
+ * interrupts off.
+ */
+static
+void
+vm_tlb_update(uint32_t ehi, uint32_t elo)
+{
+    int i;
+    
+    i = tlb_probe(ehi, 0);
+    if (i >= 0) {
+        tlb_write(ehi, elo, i);
+    }
+}
+
+/*
+ * TLB entry for resident page PADDR in region RG. Pages are only
+ * writable once they are dirty and no one else shares them copy-on-write.
+ */
+static
+uint32_t
+vm_tlblo(struct region *rg, paddr_t paddr)
+{
+    uint32_t elo = paddr | TLBLO_VALID;
+    
+    if (rg->rg_writeable &&
+        (rg->rg_shared || cm_page_refcount(paddr) == 1) &&
+        cm_page_isdirty(paddr)) {
+        elo |= TLBLO_DIRTY;
+    }
+    return elo;
+}
+
+/*
+ * Fault-around: after a miss at VADDR in region RG, also enter up to
+ * VM_FAULTAROUND of its resident neighbours, nearest first, so a scan
+ * through the region takes one miss every few pages instead of one per
+ * page. Only free slots are used; once the hand reaches a valid entry
+ * the TLB is full of things that were wanted recently and we stop. Set
+ * VM_FAULTAROUND to 0 to turn it off.
+ */
+#define VM_FAULTAROUND 4
+
+static
+void
+vm_tlb_faultaround(struct addrspace *as, struct region *rg, vaddr_t vaddr)
+{
+    uint32_t oldehi, oldelo, elo;
+    paddr_t *ptep, pte;
+    vaddr_t va;
+    unsigned k, slot;
+    
+    KASSERT(spinlock_do_i_hold(&as->as_lock));
+    
+    if (rg == NULL) {
+        return;
+    }
+    
+    for (k = 1; k <= VM_FAULTAROUND; k++) {
+        /* Alternate after and before: +1, -1, +2, -2, ... */
+        if (k % 2) {
+            va = vaddr + ((k + 1) / 2) * PAGE_SIZE;
+        }
+        else {
+            va = vaddr - (k / 2) * PAGE_SIZE;
+        }
+        if (va - rg->rg_vbase >= rg->rg_npages * PAGE_SIZE) {
+            continue;
+        }
+        
+        slot = curcpu->c_tlb_hand;
+        tlb_read(&oldehi, &oldelo, slot);
+        if (oldelo & TLBLO_VALID) {
+            return;
+        }
+        if (tlb_probe(va, 0) >= 0) {
+            continue;
+        }
+        
+        /* Only pages already in memory; nothing here may sleep */
+        ptep = as_lookup_pte(as, va, false);
+        if (ptep == NULL) {
+            continue;
+        }
+        pte = *ptep;
+        if (!PTE_ISRESIDENT(pte) || cm_page_isbusy(pte)) {
+            continue;
+        }
+        
+        cm_page_touch(pte, as);
+        elo = vm_tlblo(rg, pte);
+        as_stlb_faultaround(as, va, elo);
+        curcpu->c_tlb_hand = (slot + 1) % NUM_TLB;
+        tlb_write(va, elo, slot);
+    }
+}
+
+/*
+ * Fill the frame PADDR with the contents of the page at VADDR in region
+ * RG, whose page table entry is PTE: from swap or from the region's file.
+ */
+static
+int
+vm_pagein(struct region *rg, vaddr_t vaddr, paddr_t pte, paddr_t paddr)
+{
+    struct iovec iov;
+    struct uio u;
+    vaddr_t from, to;
+    char *kpage;
+    int result;
+    
+    if (PTE_ISSWAPPED(pte)) {
+        result = swap_in(PTE_SWAPSLOT(pte), paddr);
+        if (result) {
+            return result;
+        }
+        vmstats_inc(VMSTAT_PAGE_FAULT_DISK);
+        vmstats_inc(VMSTAT_SWAP_FILE_READ);
+        return 0;
+    }
+    
+    kpage = (char *)PADDR_TO_KVADDR(paddr);
+    
+    /* Pages with nothing from the file come from cm_getzeroedpage */
+    if (!as_region_fileslice(rg, vaddr, &from, &to)) {
+        panic("vm_pagein: 0x%x is zero fill\n", vaddr);
+    }
+    
+    /* Zero whatever the read won't cover */
+    bzero(kpage, from - vaddr);
+    bzero(kpage + (to - vaddr), vaddr + PAGE_SIZE - to);
+    
+    uio_kinit(&iov, &u, kpage + (from - vaddr), to - from,
+              rg->rg_fileoffset + (from - rg->rg_filevaddr), UIO_READ);
+    result = VOP_READ(rg->rg_vnode, &u);
+    if (result == 0 && u.uio_resid != 0) {
+        /* short read; problem with executable? */
+        kprintf("vm: short read on segment - file truncated?\n");
+        result = ENOEXEC;
+    }
+    if (result) {
+        return result;
+    }
+    
+    vmstats_inc(VMSTAT_PAGE_FAULT_DISK);
+    if (!rg->rg_mapped) {
+        /* Only reads of ELF segments count; mmap'd files don't */
+        vmstats_inc(VMSTAT_ELF_FILE_READ);
+    }
+    return 0;
+}
+
+/*
+ * Handle a write to a page of region RG that is mapped read-only in the
+ * TLB. Either this is the first write since it was paged in, and the
+ * page just becomes dirty, or the page is shared copy-on-write and we
+ * take a private copy of it. Pages of shared mappings are never copied.
+ */
+static
+int
+vm_writefault(struct addrspace *as, struct region *rg, paddr_t *ptep,
+              vaddr_t vaddr)
+{
+    paddr_t pte, paddr;
+    
+    while (true) {
+        spinlock_acquire(&as->as_lock);
+        pte = *ptep;
+        if (!PTE_ISRESIDENT(pte)) {
+            /* Paged out since it was mapped; it'll fault in again */
+            spinlock_release(&as->as_lock);
+            return 0;
+        }
+        if (cm_page_isbusy(pte)) {
+            spinlock_release(&as->as_lock);
+            cm_page_waitbusy(pte);
+            continue;
+        }
+        
+        if (rg->rg_shared || cm_page_refcount(pte) == 1) {
+            cm_page_setdirty(pte);
+            as_stlb_insert(as, vaddr, pte | TLBLO_DIRTY | TLBLO_VALID);
+            vm_tlb_update(vaddr, pte | TLBLO_DIRTY | TLBLO_VALID);
+            spinlock_release(&as->as_lock);
+            return 0;
+        }
+        
+        /* Hang on to an extra reference so it can't be evicted mid-copy */
+        if (!cm_page_incref(pte)) {
+            spinlock_release(&as->as_lock);
+            cm_page_waitbusy(pte);
+            continue;
+        }
+        spinlock_release(&as->as_lock);
+        break;
+    }
+    
+    paddr = cm_getppages(1);
+    if (paddr == 0) {
+        cm_page_decref(pte, as);
+        return ENOMEM;
+    }
+    memmove((void *)PADDR_TO_KVADDR(paddr),
+            (const void *)PADDR_TO_KVADDR(pte),
+            PAGE_SIZE);
+    cm_page_setdirty(paddr);
+    
+    spinlock_acquire(&as->as_lock);
+    KASSERT(*ptep == pte);
+    *ptep = paddr;
+    cm_page_touch(paddr, as);
+    as_stlb_insert(as, vaddr, paddr | TLBLO_DIRTY | TLBLO_VALID);
+    vm_tlb_update(vaddr, paddr | TLBLO_DIRTY | TLBLO_VALID);
+    spinlock_release(&as->as_lock);
+    
+    /* Drop both our mapping of the original and the extra reference */
+    cm_page_decref(pte, as);
+    cm_page_decref(pte, as);
+    return 0;
+}
+
+int
+vm_fault(int faulttype, vaddr_t faultaddress)
+{
+    struct addrspace *as;
+    struct region *rg;
+    paddr_t *ptep, pte, paddr, cached;
+    vaddr_t from, to;
+    off_t offset;
+    bool fromfile, shared, shareable;
+    uint32_t elo;
+    int result;
+    
+    faultaddress &= PAGE_FRAME;
+    
+    switch (faulttype) {
+        case VM_FAULT_READONLY:
+            break;
+        case VM_FAULT_READ:
+            break;
+        case VM_FAULT_WRITE:
+            break;
+        default:
+            return EINVAL;
+    }
+    
+    if (curproc == NULL) {
+        /*
+         * No process. This is probably a kernel fault early
+         * in boot. Return EFAULT so as to panic instead of
+         * getting into an infinite faulting loop.
+         */
+        return EFAULT;
+    }
+    
+    as = curproc_getas();
+    if (as == NULL) {
+        /*
+         * No address space set up. This is probably also a
+         * kernel fault early in boot.
+         */
+        return EFAULT;
+    }
+    
+    /* Recently used translations can skip the region and page table */
+    if (faulttype != VM_FAULT_READONLY) {
+        spinlock_acquire(&as->as_lock);
+        if (as_stlb_lookup(as, faultaddress, &elo)) {
+            cm_page_touch(elo & PAGE_FRAME, as);
+            vmstats_inc(VMSTAT_TLB_RELOAD);
+            vm_tlb_install(as, faultaddress, elo);
+            vm_tlb_faultaround(as, as_find_region(as, faultaddress),
+                               faultaddress);
+            spinlock_release(&as->as_lock);
+            return 0;
+        }
+        spinlock_release(&as->as_lock);
+    }
+    
+    rg = as_find_region(as, faultaddress);
+    if (rg == NULL) {
+        /* Maybe the stack just needs to grow down to it */
+        rg = as_grow_stack(as, faultaddress);
+        if (rg == NULL) {
+            return EFAULT;
+        }
+    }
+    
+    ptep = as_lookup_pte(as, faultaddress, true);
+    if (ptep == NULL) {
+        return ENOMEM;
+    }
+    
+    if (faulttype == VM_FAULT_READONLY) {
+        if (!rg->rg_writeable) {
+            // Return an error, since we tried to write to a readonly place
+            return EFAULT;
+        }
+        return vm_writefault(as, rg, ptep, faultaddress);
+    }
+    
+    while (true) {
+        spinlock_acquire(&as->as_lock);
+        pte = *ptep;
+        if (!PTE_ISRESIDENT(pte)) {
+            spinlock_release(&as->as_lock);
+            break;
+        }
+        if (cm_page_isbusy(pte)) {
+            /* Being paged out; wait and then page it back in */
+            spinlock_release(&as->as_lock);
+            cm_page_waitbusy(pte);
+            continue;
+        }
+        
+        cm_page_touch(pte, as);
+        vmstats_inc(VMSTAT_TLB_RELOAD);
+        elo = vm_tlblo(rg, pte);
+        as_stlb_insert(as, faultaddress, elo);
+        vm_tlb_install(as, faultaddress, elo);
+        vm_tlb_faultaround(as, rg, faultaddress);
+        spinlock_release(&as->as_lock);
+        return 0;
+    }
+    
+    /*
+     * Only this thread brings pages into this address space, and the
+     * pager only touches resident pages, so PTE stays put while we
+     * fetch the page without the lock.
+     */
+    fromfile = !PTE_ISSWAPPED(pte) &&
+        as_region_fileslice(rg, faultaddress, &from, &to);
+    
+    /*
+     * Pages of shared mappings always come from the page cache, so that
+     * everyone mapping the file sees the same page. Whole pages of text
+     * and read-only data go there too, to be shared with every other
+     * process running the same executable.
+     */
+    shared = fromfile && rg->rg_shared;
+    offset = rg->rg_fileoffset + (faultaddress - rg->rg_filevaddr);
+    shareable = shared || (fromfile && !rg->rg_writeable &&
+        from == faultaddress && to == faultaddress + PAGE_SIZE &&
+        (offset & ~(off_t)PAGE_FRAME) == 0);
+    
+    if (!PTE_ISSWAPPED(pte) && !fromfile) {
+        /* Zero fill; usually the idle cpus have already done the work */
+        paddr = cm_getzeroedpage();
+        if (paddr == 0) {
+            return ENOMEM;
+        }
+        vmstats_inc(VMSTAT_PAGE_FAULT_ZERO);
+    } else if (shareable &&
+               (paddr = pagecache_lookup(rg->rg_vnode, offset, shared)) != 0) {
+        vmstats_inc(VMSTAT_PAGE_FAULT_CACHED);
+    } else {
+        paddr = cm_getppages(1);
+        if (paddr == 0) {
+            return ENOMEM;
+        }
+        
+        result = vm_pagein(rg, faultaddress, pte, paddr);
+        if (result) {
+            cm_free_kpages(PADDR_TO_KVADDR(paddr));
+            return result;
+        }
+        
+        if (shareable) {
+            cached = pagecache_insert(rg->rg_vnode, offset, paddr, shared);
+            if (cached == 0 && shared) {
+                /* A private copy of a shared mapping would be wrong */
+                cm_free_kpages(PADDR_TO_KVADDR(paddr));
+                return ENOMEM;
+            }
+            if (cached != 0 && cached != paddr) {
+                /* Somebody else read it first; use theirs */
+                cm_free_kpages(PADDR_TO_KVADDR(paddr));
+                paddr = cached;
+            }
+        }
+    }
+    
+    /* Swap is given back below, so the only copy is now in memory */
+    if (PTE_ISSWAPPED(pte) ||
+        (faulttype == VM_FAULT_WRITE && rg->rg_writeable)) {
+        cm_page_setdirty(paddr);
+    }
+    
+    spinlock_acquire(&as->as_lock);
+    KASSERT(*ptep == pte);
+    *ptep = paddr;
+    cm_page_touch(paddr, as);
+    elo = vm_tlblo(rg, paddr);
+    as_stlb_insert(as, faultaddress, elo);
+    vm_tlb_install(as, faultaddress, elo);
+    vm_tlb_faultaround(as, rg, faultaddress);
+    spinlock_release(&as->as_lock);
+    
+    if (PTE_ISSWAPPED(pte)) {
+        swap_free(PTE_SWAPSLOT(pte));
+    }
+    return 0;
+}
+
+/*
+ * Called by the coremap to push the busy page PADDR out of AS, the only
+ * address space mapping it.
+ */
+int
+vm_evictpage(struct addrspace *as, paddr_t paddr)
+{
+    paddr_t *ptep, pte;
+    vaddr_t vaddr;
+    uint32_t slot;
+    int result;
+    
+    vaddr = as_reverse_lookup(as, paddr);
+    ptep = as_lookup_pte(as, vaddr, false);
+    KASSERT(ptep != NULL);
+    
+    /*
+     * Nobody maps a busy page, and anyone who mapped it just before it
+     * went busy did so holding the lock, so once we've had the lock and
+     * dropped it from the software TLB the shootdown gets every TLB
+     * entry for it.
+     */
+    spinlock_acquire(&as->as_lock);
+    KASSERT(*ptep == paddr);
+    as_stlb_invalidate(as, vaddr);
+    spinlock_release(&as->as_lock);
+    
+    vm_tlbshootdown_pages(as, vaddr, 1);
+    
+    if (cm_page_isdirty(paddr)) {
+        result = swap_out(paddr, &slot);
+        if (result) {
+            return result;
+        }
+        vmstats_inc(VMSTAT_SWAP_FILE_WRITE);
+        pte = PTE_FROMSLOT(slot);
+    }
+    else {
+        /* It can be read back from the executable or zero filled */
+        pte = 0;
+    }
+    
+    spinlock_acquire(&as->as_lock);
+    *ptep = pte;
+    spinlock_release(&as->as_lock);
+    return 0;
+}
+
+/*
+ * Called by the coremap to move the busy page FROM, mapped only by AS,
+ * to the frame TO, which it has set up to take over. Works like
+ * eviction, except that the page goes to another frame instead of swap.
+ */
+void
+vm_movepage(struct addrspace *as, paddr_t from, paddr_t to)
+{
+    paddr_t *ptep;
+    vaddr_t vaddr;
+    
+    vaddr = as_reverse_lookup(as, from);
+    ptep = as_lookup_pte(as, vaddr, false);
+    KASSERT(ptep != NULL);
+    
+    spinlock_acquire(&as->as_lock);
+    KASSERT(*ptep == from);
+    as_stlb_invalidate(as, vaddr);
+    spinlock_release(&as->as_lock);
+    
+    vm_tlbshootdown_pages(as, vaddr, 1);
+    
+    memcpy((void *)PADDR_TO_KVADDR(to), (void *)PADDR_TO_KVADDR(from),
+           PAGE_SIZE);
+    
+    spinlock_acquire(&as->as_lock);
+    *ptep = to;
+    spinlock_release(&as->as_lock);
+}